@@ -47,8 +47,6 @@
 #define G0	0
 #define G1	1
 
-int insertmode = 0;
-
 typedef struct TextAttributes {
     uint8_t fgcol:4;
     uint8_t bgcol:4;
@@ -155,6 +153,7 @@ struct selection{
 struct TextConsole {
     int text_console; /* true if text console */
     DisplayState *ds;
+    struct DisplayConsoles *dcs;
     /* Graphic console state.  */
 
     /* width and height in pixels of "frame"/display */
@@ -194,6 +193,8 @@ struct TextConsole {
     char wrapped;
     int insert_mode;
     int cursorkey_mode;
+    /* toggled by the Insert key, see kbd_put_keysym */
+    int insert_key_mode;
 
     /* display control chars */
     char display_ctrl;
@@ -231,6 +232,7 @@ struct TextConsole {
 
     /* mouse position */
     int mouse_x, mouse_y;
+    int mouse_odx;
 
     /* unicode bits (state of unicode input) */
     int unicodeIndex;
@@ -252,10 +254,20 @@ struct TextConsole {
 };
 typedef struct TextConsole TextConsole;
 
-static TextConsole *active_console;
-static TextConsole *consoles[MAX_CONSOLES];
-static int nb_consoles = 0;
-void set_color_table(DisplayState *ds); 
+/* The consoles sharing a display, of which only the active one draws.
+   Each display has its own, so that several displays can be served
+   from one process. */
+typedef struct DisplayConsoles {
+    DisplayState *ds;
+    TextConsole *active_console;
+    TextConsole *consoles[MAX_CONSOLES];
+    int nb_consoles;
+    uint32_t color_table[2][8];
+    struct DisplayConsoles *next;
+} DisplayConsoles;
+
+static DisplayConsoles *display_consoles;
+static void set_color_table(DisplayConsoles *dcs);
 
 #define clip_y(s, v) {			\
 	if ((s)->v < 0)			\
@@ -420,8 +432,6 @@ static const uint32_t dmask4[4] = {
     PAT(0xffffffff),
 };
 
-static uint32_t color_table[2][8];
-
 enum color_names {
     COLOR_BLACK   = 0,
     COLOR_RED     = 1,
@@ -552,14 +562,42 @@ static void vga_scroll(TextConsole *s, int n)
 
     if (n>0) {	// up
 	vga_bitblt(s->ds, 0, n*FONT_HEIGHT, 0, 0, s->g_width, h );
+	if (h > 0)
+	    s->ds->dpy_copy_rect(s->ds, 0, n*FONT_HEIGHT, 0, 0, s->g_width, h);
 	vga_fill_rect(s->ds, 0, h, s->g_width, (abs(n)*FONT_HEIGHT), s->t_attrib.bgcol);
     }
     else {	// down
 	vga_bitblt(s->ds, 0, 0, 0, -n*FONT_HEIGHT, s->g_width, h );
+	if (h > 0)
+	    s->ds->dpy_copy_rect(s->ds, 0, 0, 0, -n*FONT_HEIGHT, s->g_width, h);
 	vga_fill_rect(s->ds, 0, 0, s->g_width, (abs(n)*FONT_HEIGHT), s->t_attrib.bgcol);
     }
 }
 
+/* scrolls lines top..bottom of the framebuffer by N lines, the lines
+   scrolled in are left for the caller to repaint */
+static void vga_scroll_region(TextConsole *s, int top, int bottom, int n)
+{
+    int h, yf, yt;
+
+    if (s != s->dcs->active_console)
+	return;
+
+    h = (bottom - top + 1 - abs(n)) * FONT_HEIGHT;
+    if (h <= 0)
+	return;
+
+    if (n > 0) {	// up
+	yf = (top + n) * FONT_HEIGHT;
+	yt = top * FONT_HEIGHT;
+    } else {		// down
+	yf = top * FONT_HEIGHT;
+	yt = (top - n) * FONT_HEIGHT;
+    }
+    vga_bitblt(s->ds, 0, yf, 0, yt, s->g_width, h);
+    s->ds->dpy_copy_rect(s->ds, 0, yf, 0, yt, s->g_width, h);
+}
+
 static void vga_putcharxy(TextConsole *s, int x, int y, int ch, 
                           TextAttributes *t_attrib, CellAttributes *c_attrib)
 {
@@ -577,11 +615,11 @@ static void vga_putcharxy(TextConsole *s, int x, int y, int ch,
     if (t_attrib->invers ^ c_attrib->highlit ^
 	((s->cursor_visible && x == s->x && y == s->y && !s->y_scroll) ))
     {
-        bgcol = color_table[0][t_attrib->fgcol];
-        fgcol = color_table[t_attrib->bold][t_attrib->bgcol];
+        bgcol = s->dcs->color_table[0][t_attrib->fgcol];
+        fgcol = s->dcs->color_table[t_attrib->bold][t_attrib->bgcol];
     } else {
-        fgcol = color_table[t_attrib->bold][t_attrib->fgcol];
-        bgcol = color_table[0][t_attrib->bgcol];
+        fgcol = s->dcs->color_table[t_attrib->bold][t_attrib->fgcol];
+        bgcol = s->dcs->color_table[0][t_attrib->bgcol];
     }
 
     bpp = (ds->depth + 7) >> 3;
@@ -731,7 +769,7 @@ static void update_xy(TextConsole *s, int x, int y)
     if (y<0 || x<0 || x>=s->width || y>=s->height)
 	return;
 
-    if (s == active_console) {
+    if (s == s->dcs->active_console) {
 
         if (y < s->height) {
             c = &s->cells[screen_to_virtual(s,y) * s->width + x];
@@ -772,7 +810,7 @@ static void set_cursor(TextConsole *s, int x, int y)
 static void console_show_cursor(TextConsole *s, int show)
 {
     s->cursor_visible = show;
-    if (s == active_console && s->x < s->width) {
+    if (s == s->dcs->active_console && s->x < s->width) {
 	update_xy(s, s->x, s->y);
     }
 }
@@ -922,7 +960,7 @@ static void console_refresh(TextConsole *s)
     TextCell *c;
     int x, y;
 
-    if (s != active_console) 
+    if (s != s->dcs->active_console) 
         return;
 
     vga_fill_rect(s->ds, 0, 0, s->g_width, s->g_height, s->t_attrib.bgcol);
@@ -1003,9 +1041,6 @@ static void console_scroll(TextConsole *s, int ydelta)
 	    update_rect(s, 0, s->height-ydelta, s->width, ydelta );
 	else
 	    update_rect(s, 0, 0, s->width, -ydelta );
-
-	/* update whole region, because dpy_copy_rect is currently not used */
-	s->ds->dpy_update(s->ds, 0, 0, s->g_width, s->g_height);
     }
     else {
 	update_rect(s, 0, 0, s->width, s->height );
@@ -1051,7 +1086,7 @@ static void scroll_down(TextConsole* s, int n)
             n = s->sr_bottom-s->sr_top;
         }
         scroll_text_cells(s, s->sr_bottom-n, s->sr_bottom, n - s->sr_bottom + s->sr_top - 1);
-        update_rect(s, 0, s->sr_top + n, s->width, s->sr_bottom - s->sr_top - n + 1);
+        vga_scroll_region(s, s->sr_top, s->sr_bottom, -n);
         clear(s, 0, s->sr_top, s->width, n);
         
         return;
@@ -1067,7 +1102,6 @@ static void scroll_down(TextConsole* s, int n)
 
     vga_scroll(s, -n);
     clear(s, 0, s->sr_top, s->width, n);
-    s->ds->dpy_update(s->ds, 0, 0, s->g_width, s->g_height);
 }
 
 /* scrolls up, moves whole view to the -n point */
@@ -1081,7 +1115,7 @@ static void scroll_up(TextConsole* s, int n)
             n = s->sr_bottom-s->sr_top;
         }
         scroll_text_cells(s, s->sr_top+n, s->sr_top, s->sr_bottom-s->sr_top-n+1);
-        update_rect(s, 0, s->sr_top, s->width, s->sr_bottom - s->sr_top - n + 1);
+        vga_scroll_region(s, s->sr_top, s->sr_bottom, n);
         clear(s, 0, s->sr_bottom - n + 1, s->width, n);
         
         return;
@@ -1097,13 +1131,11 @@ static void scroll_up(TextConsole* s, int n)
     
     vga_scroll(s, n);
     clear(s, 0, s->sr_bottom - n + 1, s->width, n);
-    s->ds->dpy_update(s->ds, 0, 0, s->g_width, s->g_height);
 }
 
 void
 mouse_event(int dx, int dy, int dz, int buttons_state, void *opaque)
 {
-    static int odx = 0;
     int ndx;
     CharDriverState *chr = opaque;
     TextConsole *s = chr->opaque;
@@ -1178,9 +1210,9 @@ mouse_event(int dx, int dy, int dz, int buttons_state, void *opaque)
 	    highlight(s, s->selections[0].startx, s->selections[0].starty,
 		s->selections[0].endx, s->selections[0].endy, 0);
             if (dx == s->selections[0].endx) {
-                if (ndx - odx > 10) dx++;
+                if (ndx - s->mouse_odx > 10) dx++;
             } else if (dx == s->selections[0].endx - 1) {
-                if (odx - ndx < 10) dx++;
+                if (s->mouse_odx - ndx < 10) dx++;
             }
             if (dx >= s->width) dx = s->width - 1;
 
@@ -1192,7 +1224,7 @@ mouse_event(int dx, int dy, int dz, int buttons_state, void *opaque)
 		s->selections[0].endx, s->selections[0].endy, 1);
 	}
     }
-    odx = ndx;
+    s->mouse_odx = ndx;
 }
 
 static void va_write(TextConsole *s, char *f, ...)
@@ -2155,7 +2187,7 @@ static void console_putchar(TextConsole *s, int ch)
                 s->state = TTY_STATE_PALETTE;
                 break;
             case 'R':
-                set_color_table(s->ds);
+                set_color_table(s->dcs);
                 s->state = TTY_STATE_NORM;
                 break;
             default:
@@ -2174,7 +2206,7 @@ static void console_putchar(TextConsole *s, int ch)
                 g += s->palette_params[j++];
                 b = 16 * s->palette_params[j++];
                 b += s->palette_params[j];
-                *(color_table[0] + s->palette_params[0]) = col_expand(s->ds, vga_get_color(s->ds, QEMU_RGB(r, g, b)));
+                *(s->dcs->color_table[0] + s->palette_params[0]) = col_expand(s->ds, vga_get_color(s->ds, QEMU_RGB(r, g, b)));
                 s->state = TTY_STATE_NORM; 
             }
         } else
@@ -2183,15 +2215,17 @@ static void console_putchar(TextConsole *s, int ch)
     }
 }
 
-void console_select(unsigned int index)
+/* selects among the consoles on chr's display */
+void console_select(CharDriverState *chr, unsigned int index)
 {
+    DisplayConsoles *dcs = ((TextConsole *)chr->opaque)->dcs;
     TextConsole *s;
 
     if (index >= MAX_CONSOLES)
         return;
-    s = consoles[index];
+    s = dcs->consoles[index];
     if (s) {
-        active_console = s;
+        dcs->active_console = s;
         if (s->text_console) {
             if (s->g_width != s->ds->width ||
                 s->g_height != s->ds->height) {
@@ -2236,9 +2270,9 @@ static void console_send_event(CharDriverState *chr, int event)
     int i;
 
     if (event == CHR_EVENT_FOCUS) {
-        for(i = 0; i < nb_consoles; i++) {
-            if (consoles[i] == s) {
-                console_select(i);
+        for(i = 0; i < s->dcs->nb_consoles; i++) {
+            if (s->dcs->consoles[i] == s) {
+                console_select(chr, i);
                 break;
             }
         }
@@ -2280,8 +2314,15 @@ static int cmputfents(const void *p1, const void *p2)
 
 static void prepare_console_maps()
 {
+    static int maps_prepared;
     unsigned int i,j;
 
+    /* the maps are shared by all consoles, and sorting them twice
+       would scramble them */
+    if (maps_prepared)
+        return;
+    maps_prepared = 1;
+
     for(i=0;i<3;i++)
 	for(j=0;j<256;j++) {
  	    consmap[i][j] |= j<<16;
@@ -2294,10 +2335,8 @@ static void prepare_console_maps()
 	qsort( consmap[i], 256, sizeof(unsigned int), cmputfents );
 }
 
-/* Not safe after we drop privileges */
-void dump_console_to_file(CharDriverState *chr, char *fn)
+void dump_console(CharDriverState *chr, FILE *f)
 {
-    FILE* f;
     TextConsole *s = chr->opaque;
 
     if (s == NULL)
@@ -2306,10 +2345,6 @@ void dump_console_to_file(CharDriverState *chr, char *fn)
     if (s->cells == NULL)
 	return;
 
-    f=fopen(fn, "wb");
-    if (!f)
-	return;
-
     fwrite(&(s->g_width), sizeof(int), 1, f);
     fwrite(&(s->g_height), sizeof(int), 1, f);
     fwrite(&(s->total_height), sizeof(int), 1, f);
@@ -2347,6 +2382,25 @@ void dump_console_to_file(CharDriverState *chr, char *fn)
     fwrite(&(s->unicodeIndex), sizeof(int), 1, f);
     fwrite((s->unicodeData), sizeof(char), 7, f);
     fwrite(&(s->unicodeLength), sizeof(int), 1, f);
+}
+
+/* Not safe after we drop privileges */
+void dump_console_to_file(CharDriverState *chr, char *fn)
+{
+    FILE* f;
+    TextConsole *s = chr->opaque;
+
+    if (s == NULL)
+	return;
+
+    if (s->cells == NULL)
+	return;
+
+    f=fopen(fn, "wb");
+    if (!f)
+	return;
+
+    dump_console(chr, f);
     fclose(f);
 }
 
@@ -2409,15 +2463,16 @@ void load_console_from_file(CharDriverState *chr, char *fn)
 }
 
 /* called when an ascii key is pressed */
-void kbd_put_keysym(int keysym)
+void kbd_put_keysym(int keysym, void *opaque)
 {
+    CharDriverState *chr = opaque;
     TextConsole *s;
     uint8_t buf[16], *q;
     int c;
 
     dprintf("kbd_put_keysym 0x%x\n", keysym );
     
-    s = active_console;
+    s = ((TextConsole *)chr->opaque)->dcs->active_console;
     if (!s || !s->text_console)
         return;
 
@@ -2544,12 +2599,12 @@ void kbd_put_keysym(int keysym)
             *q++ = '\033';
             *q++ = '[';
             *q++ = '4';
-            if (!insertmode) {
+            if (!s->insert_key_mode) {
                 *q++ = 'h';
-                insertmode = 1;
+                s->insert_key_mode = 1;
             } else {
                 *q++ = 'l';
-                insertmode = 0;
+                s->insert_key_mode = 0;
             }
             break;
         case 0xff9f: /* KP_Delete */
@@ -2594,12 +2649,32 @@ void kbd_put_keysym(int keysym)
     }
 }
 
+static DisplayConsoles *get_display_consoles(DisplayState *ds)
+{
+    DisplayConsoles *dcs;
+
+    for (dcs = display_consoles; dcs; dcs = dcs->next)
+        if (dcs->ds == ds)
+            return dcs;
+
+    dcs = qemu_mallocz(sizeof(DisplayConsoles));
+    if (!dcs)
+        return NULL;
+    dcs->ds = ds;
+    set_color_table(dcs);
+    dcs->next = display_consoles;
+    display_consoles = dcs;
+    return dcs;
+}
+
 static TextConsole *new_console(DisplayState *ds, int text)
 {
+    DisplayConsoles *dcs;
     TextConsole *s;
     int i;
 
-    if (nb_consoles >= MAX_CONSOLES)
+    dcs = get_display_consoles(ds);
+    if (!dcs || dcs->nb_consoles >= MAX_CONSOLES)
         return NULL;
     s = qemu_mallocz(sizeof(TextConsole));
     if (!s) {
@@ -2607,22 +2682,23 @@ static TextConsole *new_console(DisplayState *ds, int text)
     }
     memset(s, 0, sizeof(TextConsole));
 
-    if (!active_console || (active_console->text_console && !text))
-        active_console = s;
+    if (!dcs->active_console || (dcs->active_console->text_console && !text))
+        dcs->active_console = s;
     s->ds = ds;
+    s->dcs = dcs;
     s->cells = 0;
     s->text_console = text;
     ds->graphic_mode = text ? 0 : 1;
     if (text) {
-        consoles[nb_consoles++] = s;
+        dcs->consoles[dcs->nb_consoles++] = s;
     } else {
         /* HACK: Put graphical consoles before text consoles.  */
-        for (i = nb_consoles; i > 0; i--) {
-            if (!consoles[i - 1]->text_console)
+        for (i = dcs->nb_consoles; i > 0; i--) {
+            if (!dcs->consoles[i - 1]->text_console)
                 break;
-            consoles[i] = consoles[i - 1];
+            dcs->consoles[i] = dcs->consoles[i - 1];
         }
-        consoles[i] = s;
+        dcs->consoles[i] = s;
     }
     s->input_stream.fd = -1;
     s->autowrap = 1;
@@ -2639,17 +2715,20 @@ TextConsole *graphic_console_init(DisplayState *ds)
     return s;
 }
 
-int is_graphic_console(void)
+int is_graphic_console(CharDriverState *chr)
 {
-    return !active_console->text_console;
+    TextConsole *s = chr->opaque;
+
+    return !s->dcs->active_console->text_console;
 }
 
-void set_color_table(DisplayState *ds) 
+static void set_color_table(DisplayConsoles *dcs)
 {
+    DisplayState *ds = dcs->ds;
     int i, j;
     for(j = 0; j < 2; j++) {
 	for(i = 0; i < 8; i++) {
-	    color_table[j][i] =
+	    dcs->color_table[j][i] =
 		col_expand(ds, vga_get_color(ds, color_table_rgb[j][i]));
 	}
     }
@@ -2666,7 +2745,6 @@ CharDriverState *text_console_init(DisplayState *ds)
 {
     CharDriverState *chr;
     TextConsole *s;
-    static int color_inited;
 
 /* init unicode maps */
 //    parse_unicode_map("/usr/share/xen/qemu/cp437_to_uni.trans");
@@ -2693,11 +2771,6 @@ CharDriverState *text_console_init(DisplayState *ds)
     s->kbd_timer = qemu_new_timer(rt_clock, kbd_send_chars, s);
 #endif
 
-    if (!color_inited) {
-        color_inited = 1;
-        set_color_table(ds);
-    }
-
     s->y_base = DEFAULT_BACKSCROLL/3;
     s->total_height = DEFAULT_BACKSCROLL;
     set_cursor(s, 0, 0);
@@ -1,5 +1,6 @@
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,8 +36,8 @@ struct CharDriverState {
 typedef struct CharDriverState CharDriverState;
 
 CharDriverState *text_console_init(DisplayState *);
-void kbd_put_keysym(int keysym);
-void console_select(unsigned int index);
+void kbd_put_keysym(int keysym, void *opaque);
+void console_select(CharDriverState *s, unsigned int index);
 void console_set_input(CharDriverState *s, int fd, void *opaque);
 int console_input_fd(CharDriverState *s);
 unsigned char nrof_clients_connected(CharDriverState *s);
@@ -44,5 +45,6 @@ unsigned char nrof_clients_connected(CharDriverState *s);
 int mouse_is_absolute(void *);
 void mouse_event(int dx, int dy, int dz, int buttons_state, void *opaque);
 
+void dump_console(CharDriverState *chr, FILE *f);
 void dump_console_to_file(CharDriverState *chr, char *fn);
 void load_console_from_file(CharDriverState *chr, char *fn);
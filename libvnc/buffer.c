@@ -4,11 +4,19 @@
 
 #include "buffer.h"
 
+/* times a buffer has had to grow */
+uint64_t buffer_reallocs;
 
 void buffer_reserve(Buffer *buffer, size_t len)
 {
     if ((buffer->capacity - buffer->offset) < len) {
-	buffer->capacity += (len + 1024);
+	/* grow geometrically so that a buffer settles at its working
+	   size after a few reallocations */
+	if (buffer->capacity * 2 >= buffer->offset + len + 1024)
+	    buffer->capacity *= 2;
+	else
+	    buffer->capacity = buffer->offset + len + 1024;
+	buffer_reallocs++;
 	buffer->buffer = realloc(buffer->buffer, buffer->capacity);
 	if (buffer->buffer == NULL) {
 	    fprintf(stderr, "vnc: out of memory\n");
@@ -19,7 +27,7 @@ void buffer_reserve(Buffer *buffer, size_t len)
 
 int buffer_empty(Buffer *buffer)
 {
-    return buffer->offset == 0;
+    return buffer->offset == buffer->head;
 }
 
 uint8_t *buffer_end(Buffer *buffer)
@@ -30,6 +38,7 @@ uint8_t *buffer_end(Buffer *buffer)
 void buffer_reset(Buffer *buffer)
 {
     buffer->offset = 0;
+    buffer->head = 0;
 }
 
 void buffer_append(Buffer *buffer, const void *data, size_t len)
@@ -38,3 +47,29 @@ void buffer_append(Buffer *buffer, const void *data, size_t len)
     buffer->offset += len;
 }
 
+uint8_t *buffer_start(Buffer *buffer)
+{
+    return buffer->buffer + buffer->head;
+}
+
+size_t buffer_length(Buffer *buffer)
+{
+    return buffer->offset - buffer->head;
+}
+
+/* Consume len bytes from the start.  What is left is only moved back
+   to the front once it is less than what has been consumed, so each
+   byte is moved at most once on average. */
+void buffer_advance(Buffer *buffer, size_t len)
+{
+    buffer->head += len;
+    if (buffer->head == buffer->offset) {
+	buffer->head = 0;
+	buffer->offset = 0;
+    } else if (buffer->head > buffer->capacity / 2) {
+	memmove(buffer->buffer, buffer->buffer + buffer->head,
+		buffer->offset - buffer->head);
+	buffer->offset -= buffer->head;
+	buffer->head = 0;
+    }
+}
@@ -5,13 +5,19 @@
 typedef struct Buffer
 {
     size_t capacity;
-    size_t offset;
+    size_t offset;		/* end of the data */
+    size_t head;		/* start of the data not yet consumed */
     uint8_t *buffer;
 } Buffer;
 
 
+extern uint64_t buffer_reallocs;
+
 void buffer_reserve(Buffer *buffer, size_t len);
 int buffer_empty(Buffer *buffer);
 uint8_t *buffer_end(Buffer *buffer);
 void buffer_reset(Buffer *buffer);
 void buffer_append(Buffer *buffer, const void *data, size_t len);
+uint8_t *buffer_start(Buffer *buffer);
+size_t buffer_length(Buffer *buffer);
+void buffer_advance(Buffer *buffer, size_t len);
@@ -159,9 +159,36 @@ static kbd_layout_t *parse_keyboard_layout(const char *language,
     return k;
 }
 
+/* Layouts are only read, so every display using a language shares the
+   one copy. */
+struct kbd_layout_cache {
+    char *language;
+    kbd_layout_t *layout;
+    struct kbd_layout_cache *next;
+};
+
+static struct kbd_layout_cache *kbd_layouts;
+
 static void *init_keyboard_layout(const char *language)
 {
-    return parse_keyboard_layout(language, 0);
+    struct kbd_layout_cache *c;
+
+    for (c = kbd_layouts; c; c = c->next)
+	if (!strcmp(c->language, language))
+	    return c->layout;
+
+    c = qemu_mallocz(sizeof(*c));
+    if (!c)
+	return NULL;
+    c->layout = parse_keyboard_layout(language, 0);
+    if (!c->layout) {
+	qemu_free(c);
+	return NULL;
+    }
+    c->language = strdup(language);
+    c->next = kbd_layouts;
+    kbd_layouts = c;
+    return c->layout;
 }
 
 static int keysym2scancode(void *kbd_layout, int keysym)
@@ -2,6 +2,8 @@
 #ifndef _LIBVNC_LIBVNC_H
 #define _LIBVNC_LIBVNC_H
 
+#include <stdio.h>
+
 /* VNC Authentication */
 #define AUTHCHALLENGESIZE 16
 
@@ -14,6 +16,8 @@ struct DisplayState {
     int height;
     int graphic_mode;
     void *opaque;
+    uint64_t damage_time; /* when the output being drawn was read, by
+			     get_clock, or 0 */
 
     void (*dpy_update)(struct DisplayState *s, int x, int y, int w, int h);
     void (*dpy_resize)(struct DisplayState *s, int w, int h);
@@ -25,6 +29,7 @@ struct DisplayState {
     
     void (*dpy_close_vncviewer_connections)(struct DisplayState *ds);
     unsigned char (*dpy_clients_connected)(struct DisplayState *ds);
+    void (*dpy_dump_stats)(struct DisplayState *ds, FILE *f);
 
     void *hw_opaque;
     void (*hw_update)(void *);
@@ -35,8 +40,9 @@ struct DisplayState {
     int (*mouse_is_absolute)(void *);
     void (*mouse_event)(int, int, int, int, void *);
 
+    void *kbd_opaque;
     void (*kbd_put_keycode)(int);
-    void (*kbd_put_keysym)(int);
+    void (*kbd_put_keysym)(int, void *);
 
     void *(*init_timer)(void (*)(void *), void *);
     uint64_t (*get_clock)(void);
@@ -52,6 +58,7 @@ struct sockaddr;
 int vnc_display_init(DisplayState *ds, struct sockaddr *sa,
 		     int find_unused, char *title, char *keyboard_layout, 
 		     unsigned int width, unsigned int height);
+void vnc_set_max_fps(DisplayState *ds, int max_fps);
 
 
 /* keyboard/mouse support */
@@ -31,6 +31,12 @@ static inline void socket_set_nonblock(int fd)
     fcntl(fd, F_SETFL, O_NONBLOCK);
 }
 
+/* keep the socket from commands the terminal runs */
+static inline void socket_set_cloexec(int fd)
+{
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
 #endif /* !_WIN32 */
 
 #endif /* QEMU_SOCKET_H */
@@ -24,6 +24,7 @@ struct TextTermClientState
     int csock;
     Buffer output;
     Buffer input;
+    int write_armed;		/* waiting for the socket to drain */
 };
 
 struct TextTermState
@@ -54,6 +55,7 @@ static void reset_tcs(struct TextTermClientState *tcs)
     tcs->csock = -1;
     buffer_reset(&tcs->input);
     buffer_reset(&tcs->output);
+    tcs->write_armed = 0;
 }
 
 static int text_term_client_io_error(struct TextTermClientState *tcs, int ret,
@@ -110,6 +112,7 @@ static void text_term_listen_read(void *opaque)
     tcs->ts = ts;
     tcs->csock = new_sock;
     socket_set_nonblock(tcs->csock);
+    socket_set_cloexec(tcs->csock);
 
     ts->ds->set_fd_handler(tcs->csock, NULL, text_term_client_read, NULL, tcs);
     ts->ds->set_fd_error_handler(tcs->csock, text_term_client_error);
@@ -151,35 +154,48 @@ static void text_term_client_read(void *opaque)
     }
 }
 
+/* The socket is only polled for writing once it is full. */
 static void text_term_client_write(void *opaque)
 {
     long ret;
+    int last_errno;
     struct TextTermClientState *tcs = opaque;
     struct TextTermState *ts = tcs->ts;
 
     while (1) {
-    	if (tcs->output.offset == 0) {
-            dprintf("disable write\n");
-            ts->ds->set_fd_handler(tcs->csock, NULL, text_term_client_read,
-                                   NULL, tcs);
+    	if (buffer_empty(&tcs->output)) {
+            if (tcs->write_armed) {
+                dprintf("disable write\n");
+                ts->ds->set_fd_handler(tcs->csock, NULL,
+                                       text_term_client_read, NULL, tcs);
+                tcs->write_armed = 0;
+            }
             break;
     	}
 
-    	dprintf("write %d\n", tcs->output.offset);
-    	ret = send(tcs->csock, tcs->output.buffer, tcs->output.offset, 0);
-    	ret = text_term_client_io_error(tcs, ret, socket_error());
+    	dprintf("write %d\n", buffer_length(&tcs->output));
+    	ret = send(tcs->csock, buffer_start(&tcs->output),
+                   buffer_length(&tcs->output), 0);
+        last_errno = socket_error();
+        if (ret == -1 &&
+            (last_errno == EAGAIN || last_errno == EWOULDBLOCK)) {
+            if (!tcs->write_armed) {
+                dprintf("enable write\n");
+                ts->ds->set_fd_handler(tcs->csock, NULL,
+                                       text_term_client_read,
+                                       text_term_client_write, tcs);
+                tcs->write_armed = 1;
+            }
+            break;
+        }
+    	ret = text_term_client_io_error(tcs, ret, last_errno);
     	if (ret <= 0) {
-            dprintf("write error %d with %d\n", errno, tcs->output.offset);
+            dprintf("write error %d with %d\n", errno,
+                    buffer_length(&tcs->output));
             return;
     	}
 
-        if (tcs->output.offset != ret)
-            memmove(tcs->output.buffer, tcs->output.buffer + ret,
-                    tcs->output.offset - ret);
-    	tcs->output.offset -= ret;
-
-    	if (tcs->output.offset)
-            break;
+        buffer_advance(&tcs->output, ret);
     }
 }
 
@@ -189,8 +205,9 @@ void text_term_chr_write(struct TextDisplayState *ds, const uint8_t *data,
     TextTermState *ts = ds->opaque;
     int i;
     for (i = 0; i < MAX_CLIENTS; i++) {
-    	if (TCS_ACTIVE(ts->tcs[i])) {
+    	if (TCS_INUSE(ts->tcs[i])) {
             text_term_write(ts->tcs[i], data, len);
+            text_term_write_pending(ts->tcs[i]);
     	}
     }
 }
@@ -199,21 +216,14 @@ static void text_term_write(struct TextTermClientState *tcs, const void *data,
                             size_t len)
 {
     buffer_reserve(&tcs->output, len);
-
-    text_term_write_pending(tcs);
-
     buffer_append(&tcs->output, data, len);
 }
 
+/* send straight away, unless the socket is full */
 static inline void text_term_write_pending(struct TextTermClientState *tcs)
 {
-    struct TextTermState *ts = tcs->ts;
-
-    if (buffer_empty(&tcs->output)) {
-	dprintf("enable write\n");
-	ts->ds->set_fd_handler(tcs->csock, NULL, text_term_client_read,
-			       text_term_client_write, tcs);
-    }
+    if (!tcs->write_armed)
+        text_term_client_write(tcs);
 }
 
 /* returns the server port number to listen to; or 0 for AN_UNIX family*/
@@ -276,6 +286,8 @@ int text_term_display_init(TextDisplayState *ds, struct sockaddr *addr,
         exit(1);
     }
 
+    socket_set_cloexec(ts->lsock);
+
     while (bind(ts->lsock, addr, addrlen) == -1) {
     	if (errno == EADDRINUSE && find_unused && addr->sa_family == AF_INET) {
             iaddr->sin_port = htons(ntohs(iaddr->sin_port) + 1);
@@ -28,9 +28,11 @@
 #include "qemu_socket.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <zlib.h>
 
 //#define DEBUG_VNC
 #ifdef DEBUG_VNC
@@ -39,19 +41,103 @@
 #define dprintf(s, ...)
 #endif
 
-/* The refresh interval starts at BASE.  If we scan the buffer and
-   find no change, we increase by INC, up to MAX.  If the mouse moves
-   or we get a keypress, the interval is set back to BASE.  If we find
-   an update, halve the interval.
+/* Updates are sent when the console draws and some client is waiting
+   for one: BATCH after the first change, so that a burst of drawing
+   goes out as one update, but at most MAX_FPS times a second.  With
+   nothing drawn there is no timer running, except for the null
+   update below.
 
-   All times in milliseconds. */
-#define VNC_REFRESH_INTERVAL_BASE 30
-#define VNC_REFRESH_INTERVAL_INC  50
-#define VNC_REFRESH_INTERVAL_MAX  2000
+   All times in microseconds, as from get_clock. */
+#define VNC_UPDATE_BATCH          4000
+#define VNC_DEFAULT_MAX_FPS       60
 
 /* Wait at most one second between updates, so that we can detect a
    minimised vncviewer reasonably quickly. */
-#define VNC_MAX_UPDATE_INTERVAL   5000
+#define VNC_MAX_UPDATE_INTERVAL   5000000
+
+/* What a separate update rectangle costs, counted in clean pixels
+   across: its header and, for hextile, resending the bg/fg.  Dirty
+   areas are merged when the clean width that takes is less. */
+#define VNC_RECT_OVERHEAD         32
+
+/* An update stops taking on region updates once this much output is
+   waiting to be sent; the rest are encoded afresh for the next one.
+   The kernel is asked to hold back writability until its unsent data
+   is below VNC_NOTSENT_LOWAT, so that encoding happens as late as
+   possible. */
+#define VNC_MAX_BACKLOG           (256 * 1024)
+#define VNC_NOTSENT_LOWAT         (32 * 1024)
+
+/* Clients with continuous updates get them without asking, each
+   followed by a fence; no more are sent while this many fences are
+   unanswered. */
+#define VNC_MAX_FRAMES_IN_FLIGHT  4
+
+/* Output latency histogram: bucket i counts updates that left the
+   socket between 2^i and 2^(i+1) microseconds after the pty output
+   they show was read. */
+#define VNC_LATENCY_BUCKETS       32
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+/* RFB rectangle encodings */
+#define VNC_ENCODING_RAW          0
+#define VNC_ENCODING_COPYRECT     1
+#define VNC_ENCODING_RRE          2
+#define VNC_ENCODING_CORRE        4
+#define VNC_ENCODING_HEXTILE      5
+#define VNC_ENCODING_TIGHT        7
+#define VNC_ENCODING_ZRLE         16
+#define VNC_ENCODING_COMPRESSLEVEL0 -256
+#define VNC_ENCODING_COMPRESSLEVEL9 -247
+#define VNC_ENCODING_LAST_RECT    -224
+#define VNC_ENCODING_FENCE        -312
+#define VNC_ENCODING_CONTINUOUS_UPDATES -313
+
+/* Fence message flags, and the payloads of the server's own fences */
+#define VNC_FENCE_BLOCK_BEFORE    0x00000001
+#define VNC_FENCE_BLOCK_AFTER     0x00000002
+#define VNC_FENCE_REQUEST         0x80000000
+#define VNC_FENCE_INIT            0
+#define VNC_FENCE_FRAME           1
+
+/* Copies and region updates queued for a client that falls this far
+   behind are replaced by a single full screen update. */
+#define VNC_MAX_PENDING_COPIES    32
+#define VNC_MAX_PENDING_REGIONS   1024
+
+/* Hextile tile cache: entries per client pixel format, and hash
+   buckets */
+#define HEXTILE_CACHE_SIZE        1024
+#define HEXTILE_CACHE_HASH        1024
+
+/* CoRRE subrect positions and sizes are single bytes */
+#define CORRE_MAX_RECT_SIZE       255
+
+/* ZRLE tiles are 64x64; palettes larger than 127 colours can only be
+   sent raw or with plain RLE. */
+#define ZRLE_TILE_SIZE            64
+#define ZRLE_MAX_PALETTE          127
+#define ZRLE_COMPRESSION          Z_DEFAULT_COMPRESSION
+
+/* Tight rectangles are limited to 2048 pixels wide and 64k pixels in
+   total.  Filtered data shorter than 12 bytes is sent uncompressed. */
+#define TIGHT_MAX_RECT_WIDTH      2048
+#define TIGHT_MAX_RECT_SIZE       65536
+#define TIGHT_MIN_TO_COMPRESS     12
+#define TIGHT_MAX_PALETTE         256
+#define TIGHT_PALETTE_HASH        512
+#define TIGHT_DEFAULT_COMPRESSION 6
+
+/* Tight zlib stream used for each filter */
+#define TIGHT_STREAM_FULL         0
+#define TIGHT_STREAM_MONO         1
+#define TIGHT_STREAM_INDEXED      2
 
 #include "vnc_keysym.h"
 #include "keymaps.c"
@@ -73,26 +159,106 @@ typedef void VncSendHextileTile(struct VncClientState *vcs,
                                 void *last_fg,
                                 int *has_bg, int *has_fg);
 
+/* The encoding of a region update queued for several clients with the
+   same pixel format and encoding.  The first of them to send it keeps
+   a copy of what it wrote for the others, which reuse it as long as
+   the region has not been redrawn in the meantime. */
+struct vnc_shared_rect {
+    struct vnc_shared_rect *next;	/* on the free list */
+    int refs;
+    int generation;		/* VncState generation when queued */
+    int encoded;
+    int n_rects;		/* rectangles in data */
+    Buffer data;
+};
+
 struct vnc_pm_region_update {
-    struct vnc_pm_region_update *next;
+    struct vnc_shared_rect *shared;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+};
+
+struct vnc_pm_copy_rect {
+    uint16_t src_x;
+    uint16_t src_y;
     uint16_t x;
     uint16_t y;
     uint16_t w;
     uint16_t h;
 };
 
+/* An encoded hextile tile, keyed by its pixels.  The background and
+   foreground are only sent when they differ from the previous tile's,
+   so they are kept apart from the rest of the encoding and the tile's
+   flags are rebuilt from the current state when the entry is used. */
+struct hextile_cache_entry {
+    struct hextile_cache_entry *hash_next;
+    struct hextile_cache_entry *lru_prev;
+    struct hextile_cache_entry *lru_next;
+    uint32_t hash;
+    uint8_t w, h;
+    uint8_t flags;		/* subencoding without bg/fg specified */
+    uint8_t bg[4], fg[4];	/* server pixels */
+    int n_data;
+    int size;			/* allocated for pixels */
+    uint8_t *pixels;		/* w * h server pixels, then n_data bytes
+				   of encoding following the bg/fg */
+};
+
+struct hextile_cache {
+    /* client pixel format */
+    int pix_bpp, pix_big_endian;
+    int red_shift, red_max;
+    int green_shift, green_max;
+    int blue_shift, blue_max;
+
+    int refs;
+    int n_entries;
+    struct hextile_cache_entry *hash[HEXTILE_CACHE_HASH];
+    struct hextile_cache_entry *lru_first, *lru_last;
+
+    uint64_t hits, misses, evictions;
+};
+
+struct tight_palette {
+    uint32_t colors[TIGHT_MAX_PALETTE];
+    int n_colors;
+    /* open addressed on the colour, entries are colour index + 1 */
+    uint16_t hash[TIGHT_PALETTE_HASH];
+};
+
 struct vnc_pm_server_cut_text {
     char *text;
 };
 
+/* Dirty state, kept per 16x16 tile: a bitmap for each row of tiles,
+   and a bit for each tile row saying whether any of its tiles are
+   dirty. */
+struct vnc_dirty {
+    uint64_t *tiles;		/* tile_words words for each tile row */
+    uint64_t *rows;		/* row_words words */
+};
+
+/* Output latency histogram, see VNC_LATENCY_BUCKETS */
+struct vnc_latency {
+    uint32_t buckets[VNC_LATENCY_BUCKETS];
+    uint64_t count, max;
+};
+
 struct vnc_pending_messages {
     uint8_t vpm_resize;
     uint8_t vpm_bell;
     uint8_t vpm_null_update;
     uint8_t vpm_server_cut_text;
     uint8_t vpm_cursor_update;
-    struct vnc_pm_region_update *vpm_region_updates;
-    struct vnc_pm_region_update **vpm_region_updates_last;
+    /* always sent all at once, so queued in fixed arrays */
+    struct vnc_pm_region_update vpm_region_updates[VNC_MAX_PENDING_REGIONS];
+    int vpm_n_region_updates;
+    /* sent ahead of the region updates */
+    struct vnc_pm_copy_rect vpm_copy_rects[VNC_MAX_PENDING_COPIES];
+    int vpm_n_copy_rects;
 };
 
 struct VncClientState
@@ -102,11 +268,18 @@ struct VncClientState
     int isvncviewer;
     Buffer output;
     Buffer input;
+    int write_armed;		/* waiting for the socket to drain */
 
     int has_resize;
-    int has_hextile;
+    int has_copyrect;
+    int has_last_rect;
+    int encoding;		/* preferred rectangle encoding */
     int has_pointer_type_change;
     int has_cursor_encoding;
+    int has_fence;
+    int has_continuous_updates;
+
+    unsigned char challenge[AUTHCHALLENGESIZE];
 
     int absolute;
     int last_x;
@@ -115,14 +288,52 @@ struct VncClientState
     /* current output mode information */
     VncWritePixels *write_pixels;
     VncSendHextileTile *send_hextile_tile;
+    struct hextile_cache *hextile_cache;
     int pix_bpp, pix_big_endian;
     int red_shift, red_max, red_shift1, red_max1;
     int green_shift, green_max, green_shift1, green_max1;
     int blue_shift, blue_max, blue_shift1, blue_max1;
+    /* client pixel for each 8bpp framebuffer pixel, in client byte
+       order, when the format has no copy fast path */
+    uint8_t pix_table[256][4];
+
+    /* ZRLE: one deflate stream for the lifetime of the connection, and
+       the uncompressed tile data of the rectangle being encoded */
+    z_stream zrle_stream;
+    int zrle_stream_active;
+    Buffer zrle;
+    int zrle_cpixel_size, zrle_cpixel_offset;
+
+    /* Tight: a deflate stream per filter type, the filtered data of
+       the rectangle being encoded and its compressed form */
+    z_stream tight_stream[4];
+    int tight_stream_active;	/* bitmask of initialised streams */
+    int tight_reset;		/* streams the client must reset */
+    int tight_level;
+    int tight_tpixel_size;
+    Buffer tight;
+    Buffer tight_zlib;
+    struct tight_palette tight_palette;
 
     VncReadEvent *read_handler;
     size_t read_handler_expect;
 
+    /* outstanding updates for this client, and the area of the
+       framebuffer it last asked for */
+    struct vnc_dirty update;
+    int update_requested;
+    int continuous_updates;	/* updates sent without requests */
+    int frames_in_flight;	/* frame fences not yet answered */
+    int update_rects;		/* rectangles written in the current
+				 * FramebufferUpdate */
+    uint64_t damage_time;	/* oldest output not yet in an update */
+    uint64_t sent_damage_time;	/* that of the update being sent */
+    struct vnc_latency latency;
+    int visible_x;
+    int visible_y;
+    int visible_w;
+    int visible_h;
+
     struct vnc_pending_messages vpm;
 };
 
@@ -136,35 +347,52 @@ struct VncState
     char *title;
 
     void *timer;
-    int timer_interval;
+    int update_scheduled;	/* timer armed for outstanding updates */
+    int frame_interval;		/* least time between updates */
     int64_t last_update_time;
 
     int lsock;
 
     DisplayState *ds;
     struct VncClientState *vcs[MAX_CLIENTS];
-
-    int dirty_pixel_shift;
-    uint64_t *update_row;	/* outstanding updates */
-    int has_update;		/* there's outstanding updates in the
-				 * visible area */
+    struct hextile_cache *hextile_caches[MAX_CLIENTS];
+
+    int tile_cols, tile_rows;	/* dirty bitmap geometry, in tiles */
+    int tile_words, row_words;	/* and in words */
+    struct vnc_dirty update;	/* console updates not yet handed to
+				 * the clients */
+    uint8_t *shadow;		/* framebuffer as last queued to clients */
+    struct vnc_dirty refresh;	/* updates to send even if the shadow
+				 * says they did not change anything */
+    uint64_t shadow_compared, shadow_unchanged;	/* dirty bytes */
+    uint64_t damage_time;	/* oldest output in update */
+    int has_update;		/* update is not empty */
+    int generation;		/* bumped by update passes, copies and
+				 * resizes */
+    uint64_t shared_encoded, shared_reused;
+    struct vnc_shared_rect *shared_free;
+
+    /* heap allocations made to queue and encode updates, and the
+       number of update passes since the last one */
+    uint64_t update_allocs, update_allocs_seen;
+    int alloc_free_updates;
+
+    /* region updates put back for lack of room in an update, and
+       outstanding dirty tiles made redundant by one */
+    uint64_t updates_deferred, tiles_superseded;
 
     int depth; /* internal VNC frame buffer byte per pixel */
 
-    int visible_x;
-    int visible_y;
-    int visible_w;
-    int visible_h;
-
     const char *display;
 
+    char vncpasswd[64];		/* no authentication if empty */
+
     char *kbd_layout_name;
     kbd_layout_t *kbd_layout;
 
     /* input */
     uint8_t modifiers_state[256];
 
-    int update_requested;
     int send_resize;
 
     char *server_cut_text;
@@ -176,11 +404,15 @@ struct VncState
 static VncState *vnc_state; /* needed for info vnc */
 #endif
 
-#define DIRTY_PIXEL_BITS 64
-#define X2DP_DOWN(vs, x) ((x) >> (vs)->dirty_pixel_shift)
-#define X2DP_UP(vs, x) \
-  (((x) + (1ULL << (vs)->dirty_pixel_shift) - 1) >> (vs)->dirty_pixel_shift)
-#define DP2X(vs, x) ((x) << (vs)->dirty_pixel_shift)
+/* Dirty tiles are the size of hextile tiles, whatever the size of
+   the screen.  Finding them goes by the tile row bits and then the
+   tile bits, so it takes time in proportion to the number of dirty
+   tiles rather than to the screen size. */
+#define VNC_TILE_SHIFT 4
+#define VNC_TILE_SIZE (1 << VNC_TILE_SHIFT)
+#define X2T_DOWN(x) ((x) >> VNC_TILE_SHIFT)
+#define X2T_UP(x) (((x) + VNC_TILE_SIZE - 1) >> VNC_TILE_SHIFT)
+#define T2X(t) ((t) << VNC_TILE_SHIFT)
 
 #if 0
 void do_info_vnc(void)
@@ -217,8 +449,10 @@ static void vnc_write_u8(struct VncClientState *vcs, uint8_t value);
 static void vnc_flush(struct VncClientState *vcs);
 static void _vnc_update_client(void *opaque);
 static void vnc_update_client(void *opaque);
+static void vnc_schedule_update(VncState *vs);
 static void vnc_client_read(void *opaque);
-static void framebuffer_set_updated(VncState *vs, int x, int y, int w, int h);
+static void framebuffer_set_updated(struct VncClientState *vcs,
+				    int x, int y, int w, int h);
 static int make_challenge(unsigned char *random, int size);
 static void set_seed(unsigned int *seedp);
 static void get_random(int len, unsigned char *buf);
@@ -266,36 +500,112 @@ static inline int vnc_and_bits(const uint32_t *d1, const uint32_t *d2,
 }
 #endif
 
-static void set_bits_in_row(VncState *vs, uint64_t *row,
-			    int x, int y, int w, int h)
+/* the bits of word i of a bitmap that are in [from, to) */
+static inline uint64_t bits_in_word(int i, int from, int to)
 {
-    int x1, x2;
-    uint64_t mask;
+    from -= i * 64;
+    to -= i * 64;
+    if (from < 0)
+	from = 0;
+    if (to > 64)
+	to = 64;
+    if (from >= to)
+	return 0;
+    if (to - from == 64)
+	return ~(0ULL);
+    return ((1ULL << (to - from)) - 1) << from;
+}
 
-    if (w == 0)
-	return;
+static int vnc_dirty_alloc(VncState *vs, struct vnc_dirty *d)
+{
+    free(d->tiles);
+    free(d->rows);
+    d->tiles = qemu_mallocz(vs->tile_rows * vs->tile_words *
+			    sizeof(d->tiles[0]));
+    d->rows = qemu_mallocz(vs->row_words * sizeof(d->rows[0]));
+    return d->tiles && d->rows ? 0 : -1;
+}
 
-    x1 = X2DP_DOWN(vs, x);
-    x2 = X2DP_UP(vs, x + w);
+static void vnc_dirty_free(struct vnc_dirty *d)
+{
+    free(d->tiles);
+    free(d->rows);
+    d->tiles = NULL;
+    d->rows = NULL;
+}
 
-    if (X2DP_UP(vs, w) != DIRTY_PIXEL_BITS)
-	mask = ((1ULL << (x2 - x1)) - 1) << x1;
-    else
-	mask = ~(0ULL);
+static inline uint64_t *vnc_dirty_row(VncState *vs, struct vnc_dirty *d,
+				      int ty)
+{
+    return d->tiles + ty * vs->tile_words;
+}
+
+/* bring the bit for tile row ty up to date with its tiles */
+static void vnc_dirty_sync_row(VncState *vs, struct vnc_dirty *d, int ty)
+{
+    uint64_t *row = vnc_dirty_row(vs, d, ty);
+    int i;
+
+    for (i = 0; i < vs->tile_words; i++) {
+	if (row[i]) {
+	    d->rows[ty / 64] |= 1ULL << (ty % 64);
+	    return;
+	}
+    }
+    d->rows[ty / 64] &= ~(1ULL << (ty % 64));
+}
+
+static void vnc_dirty_set(VncState *vs, struct vnc_dirty *d,
+			  int x, int y, int w, int h)
+{
+    uint64_t *row;
+    int tx1, tx2, ty, ty2, i;
+
+    tx1 = X2T_DOWN(x);
+    tx2 = MIN(X2T_UP(x + w), vs->tile_cols);
+    ty2 = MIN(X2T_UP(y + h), vs->tile_rows);
+    if (tx1 >= tx2)
+	return;
+    for (ty = X2T_DOWN(y); ty < ty2; ty++) {
+	row = vnc_dirty_row(vs, d, ty);
+	for (i = tx1 / 64; i <= (tx2 - 1) / 64; i++)
+	    row[i] |= bits_in_word(i, tx1, tx2);
+	d->rows[ty / 64] |= 1ULL << (ty % 64);
+    }
+}
+
+/* whether any tile the rectangle touches is dirty */
+static int vnc_dirty_test(VncState *vs, struct vnc_dirty *d,
+			  int x, int y, int w, int h)
+{
+    uint64_t *row;
+    int tx1, tx2, ty, ty2, i;
 
-    h += y;
-    if (h > vs->ds->height)
-        h = vs->ds->height;
-    for (; y < h; y++)
-	row[y] |= mask;
+    tx1 = X2T_DOWN(x);
+    tx2 = MIN(X2T_UP(x + w), vs->tile_cols);
+    ty2 = MIN(X2T_UP(y + h), vs->tile_rows);
+    if (tx1 >= tx2)
+	return 0;
+    for (ty = X2T_DOWN(y); ty < ty2; ty++) {
+	if (!(d->rows[ty / 64] & (1ULL << (ty % 64))))
+	    continue;
+	row = vnc_dirty_row(vs, d, ty);
+	for (i = tx1 / 64; i <= (tx2 - 1) / 64; i++)
+	    if (row[i] & bits_in_word(i, tx1, tx2))
+		return 1;
+    }
+    return 0;
 }
 
 static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
 {
     VncState *vs = ds->opaque;
 
-    set_bits_in_row(vs, vs->update_row, x, y, w, h);
+    vnc_dirty_set(vs, &vs->update, x, y, w, h);
+    if (ds->damage_time && !vs->damage_time)
+	vs->damage_time = ds->damage_time;
     vs->has_update = 1;
+    vnc_schedule_update(vs);
 }
 
 static unsigned char vnc_dpy_clients_connected(DisplayState *ds)
@@ -319,6 +629,18 @@ static void vnc_framebuffer_update(struct VncClientState *vcs, int x, int y,
     vnc_write_u16(vcs, h);
 
     vnc_write_s32(vcs, encoding);
+    vcs->update_rects++;
+}
+
+static void vnc_write_fence(struct VncClientState *vcs, uint32_t flags,
+			    uint8_t *payload, int len)
+{
+    vnc_write_u8(vcs, 248);	/* ServerFence */
+    vnc_write_u8(vcs, 0);	/* padding */
+    vnc_write_u16(vcs, 0);
+    vnc_write_u32(vcs, flags);
+    vnc_write_u8(vcs, len);
+    vnc_write(vcs, payload, len);
 }
 
 static void vnc_send_bell(DisplayState *ds)
@@ -358,49 +680,125 @@ static void vnc_send_resize(DisplayState *ds)
     }
 }
 
-static void vnc_flush_region_updates(struct vnc_pending_messages *vpm)
+/* shared rects are kept on a free list with their buffers, for reuse */
+static struct vnc_shared_rect *vnc_shared_rect_get(VncState *vs)
+{
+    struct vnc_shared_rect *sr = vs->shared_free;
+
+    if (sr) {
+	vs->shared_free = sr->next;
+	buffer_reset(&sr->data);
+	sr->encoded = 0;
+	return sr;
+    }
+    vs->update_allocs++;
+    return calloc(1, sizeof(struct vnc_shared_rect));
+}
+
+static void vnc_shared_rect_release(VncState *vs, struct vnc_shared_rect *sr)
+{
+    if (sr == NULL || --sr->refs)
+	return;
+    sr->next = vs->shared_free;
+    vs->shared_free = sr;
+}
+
+static void vnc_flush_region_updates(struct VncClientState *vcs)
+{
+    struct vnc_pending_messages *vpm = &vcs->vpm;
+    int i;
+
+    for (i = 0; i < vpm->vpm_n_region_updates; i++)
+	vnc_shared_rect_release(vcs->vs, vpm->vpm_region_updates[i].shared);
+    vpm->vpm_n_region_updates = 0;
+    vpm->vpm_n_copy_rects = 0;
+}
+
+/* Returns NULL if the region is already covered by a full screen
+   update, which replaces the queue once it is full. */
+static struct vnc_pm_region_update *
+vnc_queue_region_update(struct VncClientState *vcs, int x, int y, int w, int h)
 {
+    struct vnc_pending_messages *vpm = &vcs->vpm;
+    struct VncState *vs = vcs->vs;
     struct vnc_pm_region_update *rup;
-    
-    while (vpm->vpm_region_updates) {
-	rup = vpm->vpm_region_updates;
-	vpm->vpm_region_updates = rup->next;
-	free(rup);
+    int i;
+
+    rup = vpm->vpm_region_updates;
+    if (vpm->vpm_n_region_updates && rup->w == vs->ds->width &&
+	rup->h == vs->ds->height)
+	return NULL;
+
+    if (vpm->vpm_n_region_updates == VNC_MAX_PENDING_REGIONS) {
+	dprintf("client %d behind, sending full update\n", vcs->csock);
+	for (i = 0; i < vpm->vpm_n_region_updates; i++)
+	    vnc_shared_rect_release(vs, vpm->vpm_region_updates[i].shared);
+	vpm->vpm_n_region_updates = 0;
+	x = y = 0;
+	w = vs->ds->width;
+	h = vs->ds->height;
     }
-    vpm->vpm_region_updates_last = &vpm->vpm_region_updates;
+
+    rup = &vpm->vpm_region_updates[vpm->vpm_n_region_updates++];
+    rup->shared = NULL;
+    rup->x = x;
+    rup->y = y;
+    rup->w = w;
+    rup->h = h;
+
+    dprintf("created rup %d %p %d %d %d %d %d %d\n", vcs->csock,
+	    rup, x, y, w, h, vcs->pix_bpp, vcs->vs->depth);
+    return rup;
 }
 
-static void vnc_reset_pending_messages(struct vnc_pending_messages *vpm)
+static void vnc_reset_pending_messages(struct VncClientState *vcs)
 {
+    struct vnc_pending_messages *vpm = &vcs->vpm;
+
     vpm->vpm_resize = 0;
     vpm->vpm_bell = 0;
     vpm->vpm_server_cut_text = 0;
-    vnc_flush_region_updates(vpm);
+    vnc_flush_region_updates(vcs);
 }
 
 static void vnc_dpy_resize(DisplayState *ds, int w, int h)
 {
     VncState *vs = ds->opaque;
-    int o, i;
+    int i;
 
     for (i = 0; i < MAX_CLIENTS; i++) {
 	if (!VCS_ACTIVE(vs->vcs[i]))
 	    continue;
-	vnc_flush_region_updates(&vs->vcs[i]->vpm);
+	vnc_flush_region_updates(vs->vcs[i]);
     }
     dprintf("dpy resize w %d->%d h %d->%d depth %d\n", ds->width, w,
 	    ds->height, h, vs->depth);
 
     if (w != ds->width || h != ds->height || w * vs->depth != ds->linesize) {
 	free(ds->data);
-	free(vs->update_row);
+	free(vs->shadow);
 	ds->data = qemu_mallocz(w * h * vs->depth);
-	vs->update_row = qemu_mallocz(h * sizeof(vs->update_row[0]));
-
-	if (ds->data == NULL || /*vs->dirty_row == NULL || */vs->update_row == NULL) {
+	vs->shadow = qemu_mallocz(w * h * vs->depth);
+	vs->tile_cols = X2T_UP(w);
+	vs->tile_rows = X2T_UP(h);
+	vs->tile_words = (vs->tile_cols + 63) / 64;
+	vs->row_words = (vs->tile_rows + 63) / 64;
+
+	if (ds->data == NULL || vs->shadow == NULL ||
+	    vnc_dirty_alloc(vs, &vs->update) == -1 ||
+	    vnc_dirty_alloc(vs, &vs->refresh) == -1) {
 	    fprintf(stderr, "vnc: memory allocation failed\n");
 	    exit(1);
 	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+	    if (!VCS_INUSE(vs->vcs[i]))
+		continue;
+	    if (vnc_dirty_alloc(vs, &vs->vcs[i]->update) == -1) {
+		fprintf(stderr, "vnc: memory allocation failed\n");
+		exit(1);
+	    }
+	}
     }
 
     if (ds->depth != vs->depth * 8) {
@@ -411,12 +809,19 @@ static void vnc_dpy_resize(DisplayState *ds, int w, int h)
     ds->width = w;
     ds->height = h;
     ds->linesize = w * vs->depth;
-    vs->dirty_pixel_shift = 0;
-    for (o = DIRTY_PIXEL_BITS; o < ds->width; o *= 2)
-	vs->dirty_pixel_shift++;
     if (ds->width != w || ds->height != h)
 	vnc_send_resize(ds);
-    framebuffer_set_updated(vs, 0, 0, ds->width, ds->height);
+    vs->generation++;
+
+    /* every client gets the new framebuffer, and the shadow is
+       brought up to date with it */
+    vnc_dirty_set(vs, &vs->update, 0, 0, ds->width, ds->height);
+    vnc_dirty_set(vs, &vs->refresh, 0, 0, ds->width, ds->height);
+    vs->has_update = 1;
+    for (i = 0; i < MAX_CLIENTS; i++)
+	if (VCS_INUSE(vs->vcs[i]))
+	    framebuffer_set_updated(vs->vcs[i], 0, 0, ds->width, ds->height);
+    vnc_schedule_update(vs);
 }
 
 /* fastest code */
@@ -449,21 +854,82 @@ static void vnc_convert_pixel(struct VncClientState *vcs, uint8_t *buf,
         break;
     default:
     case 4:
+    {
+        uint32_t p = ((uint32_t)r << vcs->red_shift) |
+            ((uint32_t)g << vcs->green_shift) | ((uint32_t)b << vcs->blue_shift);
         if (vcs->pix_big_endian) {
-            buf[0] = 255;
-            buf[1] = r;
-            buf[2] = g;
-            buf[3] = b;
+            buf[0] = p >> 24;
+            buf[1] = p >> 16;
+            buf[2] = p >> 8;
+            buf[3] = p;
         } else {
-            buf[0] = b;
-            buf[1] = g;
-            buf[2] = r;
-            buf[3] = 255;
+            buf[0] = p;
+            buf[1] = p >> 8;
+            buf[2] = p >> 16;
+            buf[3] = p >> 24;
         }
+    }
         break;
     }
 }
 
+static void vnc_build_pix_table(struct VncClientState *vcs)
+{
+    int v;
+
+    for (v = 0; v < 256; v++)
+        vnc_convert_pixel(vcs, vcs->pix_table[v], v);
+}
+
+#define BPP 8
+#include "vnctrans.h"
+#undef BPP
+
+#define BPP 16
+#include "vnctrans.h"
+#undef BPP
+
+#define BPP 32
+#include "vnctrans.h"
+#undef BPP
+
+/* convert a single framebuffer pixel to the client's pixel format */
+static void vnc_pixel_to_client(struct VncClientState *vcs, uint8_t *buf,
+				uint32_t v)
+{
+    if (vcs->write_pixels == vnc_write_pixels_copy) {
+	switch (vcs->vs->depth) {
+	case 1:
+	    buf[0] = v;
+	    break;
+	case 2:
+	    *(uint16_t *)buf = v;
+	    break;
+	default:
+	case 4:
+	    *(uint32_t *)buf = v;
+	    break;
+	}
+    } else if (vcs->vs->depth == 1) {
+	memcpy(buf, vcs->pix_table[v], vcs->pix_bpp);
+    } else {
+	vnc_convert_pixel(vcs, buf, v);
+    }
+}
+
+/* a framebuffer pixel stored at p */
+static uint32_t vnc_pixel_value(VncState *vs, const uint8_t *p)
+{
+    switch (vs->depth) {
+    case 1:
+	return p[0];
+    case 2:
+	return *(uint16_t *)p;
+    default:
+	return *(uint32_t *)p;
+    }
+}
+
 static void vnc_write_pixels_generic(struct VncClientState *vcs,
                      void *pixels1, int size)
 {
@@ -564,7 +1030,7 @@ static void writeZero(struct VncClientState *vcs, unsigned char **cur)
 
 static void vnc_send_custom_cursor(struct VncClientState *vcs)
 {
-    unsigned char *cursorcur, *cur;
+    unsigned char cursorcur[sizeof(cursorbmsk) * 8 * 4], *cur;
     unsigned int size, i, j;
      
     if (vcs->has_cursor_encoding != 1)
@@ -573,224 +1039,1632 @@ static void vnc_send_custom_cursor(struct VncClientState *vcs)
     dprintf("sending custom cursor %d with bpp %d\n", vcs->csock,
         vcs->pix_bpp);
     size = sizeof(cursorbmsk) * 8 * vcs->pix_bpp;
-    cursorcur = malloc(size);
-    if (cursorcur == NULL)
-    return;
 
-    cur = (unsigned char *) cursorcur;
+    cur = (unsigned char *) cursorcur;
+
+    for (i = 0; i < sizeof(cursorbmsk); i++) {
+        for (j = 0; j < 8; j++) {
+            if (cursorbmsk[i] & (1 << (8 - j)))
+                writeGrey(vcs, &cur);
+            else
+                writeZero(vcs, &cur);
+        }
+    }
+
+    vnc_write_u16(vcs, 0);
+    vnc_write_u16(vcs, 1); /* number of rects */
+
+    /* width 8, height - number of bytes in mask, hotspot in the middle */
+    vnc_framebuffer_update(vcs, 8 / 2, sizeof(cursorbmsk) / 2, 8,
+               sizeof(cursorbmsk), -239);
+    vnc_write_pixels_copy(vcs, cursorcur, size);
+    vnc_write(vcs, cursorbmsk, sizeof(cursorbmsk));
+}
+
+/* Outstanding updates in the source of a copy are carried over to the
+   destination: clients copy whatever they currently show there. */
+static void vnc_dirty_copy(VncState *vs, struct vnc_dirty *d,
+			   int xf, int yf, int xt, int yt, int w, int h)
+{
+    uint64_t *from, *to, inner;
+    int tx1, tx2, itx1, itx2, ity1, ity2, ty1, ty2, dty, ty, i;
+
+    /* anything but a vertical move by whole tiles, such as a scroll,
+       just dirties the destination */
+    if (xf != xt || (yt - yf) % VNC_TILE_SIZE) {
+	if (vnc_dirty_test(vs, d, xf, yf, w, h))
+	    vnc_dirty_set(vs, d, xt, yt, w, h);
+	return;
+    }
+
+    dty = (yt - yf) / VNC_TILE_SIZE;
+    tx1 = X2T_DOWN(xt);
+    tx2 = MIN(X2T_UP(xt + w), vs->tile_cols);
+    ty1 = X2T_DOWN(yt);
+    ty2 = MIN(X2T_UP(yt + h), vs->tile_rows);
+    if (tx1 >= tx2 || ty1 >= ty2)
+	return;
+
+    /* tiles entirely overwritten by the copy lose their own state */
+    itx1 = X2T_UP(xt);
+    itx2 = xt + w >= vs->ds->width ? vs->tile_cols : X2T_DOWN(xt + w);
+    ity1 = X2T_UP(yt);
+    ity2 = yt + h >= vs->ds->height ? vs->tile_rows : X2T_DOWN(yt + h);
+
+    for (ty = dty < 0 ? ty1 : ty2 - 1; ty >= ty1 && ty < ty2;
+	 ty += dty < 0 ? 1 : -1) {
+	from = vnc_dirty_row(vs, d, ty - dty);
+	to = vnc_dirty_row(vs, d, ty);
+	for (i = tx1 / 64; i <= (tx2 - 1) / 64; i++) {
+	    inner = ty >= ity1 && ty < ity2 ? bits_in_word(i, itx1, itx2) : 0;
+	    to[i] = (to[i] & ~inner) | (from[i] & bits_in_word(i, tx1, tx2));
+	}
+	vnc_dirty_sync_row(vs, d, ty);
+    }
+}
+
+/* the shadow framebuffer follows the copy the clients are sent */
+static void vnc_copy_shadow(VncState *vs, int xf, int yf, int xt, int yt,
+			    int w, int h)
+{
+    int linesize = vs->ds->linesize;
+    int j;
+
+    if (yt < yf) {
+	for (j = 0; j < h; j++)
+	    memmove(vs->shadow + (yt + j) * linesize + xt * vs->depth,
+		    vs->shadow + (yf + j) * linesize + xf * vs->depth,
+		    w * vs->depth);
+    } else {
+	for (j = h - 1; j >= 0; j--)
+	    memmove(vs->shadow + (yt + j) * linesize + xt * vs->depth,
+		    vs->shadow + (yf + j) * linesize + xf * vs->depth,
+		    w * vs->depth);
+    }
+}
+
+static int vnc_region_update_pending(struct vnc_pending_messages *vpm,
+				     int x, int y, int w, int h)
+{
+    struct vnc_pm_region_update *rup;
+    int i;
+
+    for (i = 0; i < vpm->vpm_n_region_updates; i++) {
+	rup = &vpm->vpm_region_updates[i];
+	if (rup->x <= x && rup->y <= y && rup->x + rup->w >= x + w &&
+	    rup->y + rup->h >= y + h)
+	    return 1;
+    }
+    return 0;
+}
+
+static void vnc_queue_copy_rect(struct VncClientState *vcs, int xf, int yf,
+				int xt, int yt, int w, int h)
+{
+    struct vnc_pending_messages *vpm = &vcs->vpm;
+    struct vnc_pm_region_update *rup;
+    struct vnc_pm_copy_rect *cr;
+    int x1, y1, x2, y2, i, n;
+
+    /* Region updates are sent after the copies, so the client copies
+       stale pixels from any part of the source they cover: repaint
+       those at the destination too. */
+    n = vpm->vpm_n_region_updates;
+    for (i = 0; i < n && vpm->vpm_n_region_updates < VNC_MAX_PENDING_REGIONS;
+	 i++) {
+	rup = &vpm->vpm_region_updates[i];
+	x1 = MAX(rup->x, xf);
+	y1 = MAX(rup->y, yf);
+	x2 = MIN(rup->x + rup->w, xf + w);
+	y2 = MIN(rup->y + rup->h, yf + h);
+	x1 += xt - xf;
+	x2 += xt - xf;
+	y1 += yt - yf;
+	y2 += yt - yf;
+	if (x1 < x2 && y1 < y2 &&
+	    !vnc_region_update_pending(vpm, x1, y1, x2 - x1, y2 - y1))
+	    vnc_queue_region_update(vcs, x1, y1, x2 - x1, y2 - y1);
+    }
+
+    if (vpm->vpm_n_region_updates == VNC_MAX_PENDING_REGIONS ||
+	vpm->vpm_n_copy_rects == VNC_MAX_PENDING_COPIES) {
+	dprintf("client %d behind, sending full update\n", vcs->csock);
+	vnc_flush_region_updates(vcs);
+	vnc_queue_region_update(vcs, 0, 0, vcs->vs->ds->width,
+				vcs->vs->ds->height);
+	return;
+    }
+
+    cr = &vpm->vpm_copy_rects[vpm->vpm_n_copy_rects++];
+    cr->src_x = xf;
+    cr->src_y = yf;
+    cr->x = xt;
+    cr->y = yt;
+    cr->w = w;
+    cr->h = h;
+}
+
+static void vnc_dpy_copy_rect(DisplayState *ds, int xf, int yf, int xt, int yt, int w, int h)
+{
+    struct VncState *vs = ds->opaque;
+    struct VncClientState *vcs;
+    int i;
+
+    dprintf("queueing copy rect. %d,%d->%d,%d [%d,%d]\n", xf, yf, xt, yt, w, h);
+
+    if (w <= 0 || h <= 0)
+	return;
+
+    vnc_dirty_copy(vs, &vs->update, xf, yf, xt, yt, w, h);
+    vnc_dirty_copy(vs, &vs->refresh, xf, yf, xt, yt, w, h);
+    vnc_copy_shadow(vs, xf, yf, xt, yt, w, h);
+    vs->generation++;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	if (!VCS_INUSE(vs->vcs[i]))
+	    continue;
+	
+	vcs = vs->vcs[i];
+
+	vnc_dirty_copy(vs, &vcs->update, xf, yf, xt, yt, w, h);
+	if (!VCS_ACTIVE(vcs))
+	    continue;
+	if (vcs->has_copyrect)
+	    vnc_queue_copy_rect(vcs, xf, yf, xt, yt, w, h);
+	else
+	    vnc_dirty_set(vs, &vcs->update, xt, yt, w, h);
+	if (ds->damage_time && !vcs->damage_time)
+	    vcs->damage_time = ds->damage_time;
+    }
+
+    vs->has_update = 1;
+    vnc_schedule_update(vs);
+}
+
+static void hextile_enc_cord(uint8_t *ptr, int x, int y, int w, int h)
+{
+    ptr[0] = ((x & 0x0F) << 4) | (y & 0x0F);
+    ptr[1] = (((w - 1) & 0x0F) << 4) | ((h - 1) & 0x0F);
+}
+
+/* Tiles are written straight into the output buffer, which is
+   reserved for a row of tiles at a time.  The worst case is a
+   coloured subrect for every pixel, with bg and fg. */
+#define HEXTILE_MAX_TILE_SIZE(bpp) (2 + 2 * (bpp) + 16 * 16 * ((bpp) + 2))
+
+#include "vnchextile_simd.h"
+
+#define BPP 8
+#include "vnchextile.h"
+#undef BPP
+
+#define BPP 16
+#include "vnchextile.h"
+#undef BPP
+
+#define BPP 32
+#include "vnchextile.h"
+#undef BPP
+
+#define GENERIC
+#define BPP 8
+#include "vnchextile.h"
+#undef BPP
+#undef GENERIC
+
+#define GENERIC
+#define BPP 16
+#include "vnchextile.h"
+#undef BPP
+#undef GENERIC
+
+#define GENERIC
+#define BPP 32
+#include "vnchextile.h"
+#undef BPP
+#undef GENERIC
+
+static void zrle_put_u8(struct VncClientState *vcs, uint8_t value)
+{
+    buffer_reserve(&vcs->zrle, 1);
+    buffer_append(&vcs->zrle, &value, 1);
+}
+
+/* CPIXEL: a client pixel, with the unused byte dropped for 24-bit
+   colour in a 32-bit pixel */
+static void zrle_put_cpixel(struct VncClientState *vcs, uint32_t v)
+{
+    uint8_t buf[4];
+
+    vnc_pixel_to_client(vcs, buf, v);
+    buffer_reserve(&vcs->zrle, vcs->zrle_cpixel_size);
+    buffer_append(&vcs->zrle, buf + vcs->zrle_cpixel_offset,
+		  vcs->zrle_cpixel_size);
+}
+
+static void zrle_put_run_length(struct VncClientState *vcs, int len)
+{
+    len--;
+    while (len >= 255) {
+	zrle_put_u8(vcs, 255);
+	len -= 255;
+    }
+    zrle_put_u8(vcs, len);
+}
+
+#define BPP 8
+#include "vnczrle.h"
+#undef BPP
+
+#define BPP 16
+#include "vnczrle.h"
+#undef BPP
+
+#define BPP 32
+#include "vnczrle.h"
+#undef BPP
+
+#define BPP 8
+#include "vncrre.h"
+#undef BPP
+
+#define BPP 16
+#include "vncrre.h"
+#undef BPP
+
+#define BPP 32
+#include "vncrre.h"
+#undef BPP
+
+static void send_raw_rect(struct VncClientState *vcs, int x, int y,
+			  int w, int h)
+{
+    struct VncState *vs = vcs->vs;
+    uint8_t *row;
+    int i;
+
+    row = vs->ds->data + y * vs->ds->linesize + x * vs->depth;
+    for (i = 0; i < h; i++) {
+	vcs->write_pixels(vcs, row, w * vs->depth);
+	row += vs->ds->linesize;
+    }
+}
+
+/* send a rectangle as RRE or CoRRE, or as raw pixels if those are
+   smaller */
+static void send_rre_rect(struct VncClientState *vcs, int x, int y,
+			  int w, int h, int encoding)
+{
+    struct VncState *vs = vcs->vs;
+    int compact = encoding == VNC_ENCODING_CORRE;
+    size_t offset;
+    uint8_t *row;
+    int n, update_rects;
+
+    row = vs->ds->data + y * vs->ds->linesize + x * vs->depth;
+    /* to take the rectangle back if it comes out larger than raw */
+    offset = vcs->output.offset;
+    update_rects = vcs->update_rects;
+    vnc_framebuffer_update(vcs, x, y, w, h, encoding);
+    switch (vs->depth) {
+    case 1:
+	n = send_rre_8(vcs, row, vs->ds->linesize, w, h, compact);
+	break;
+    case 2:
+	n = send_rre_16(vcs, row, vs->ds->linesize, w, h, compact);
+	break;
+    default:
+    case 4:
+	n = send_rre_32(vcs, row, vs->ds->linesize, w, h, compact);
+	break;
+    }
+    if (n == -1) {
+	vcs->output.offset = offset;
+	vcs->update_rects = update_rects;
+	vnc_framebuffer_update(vcs, x, y, w, h, VNC_ENCODING_RAW);
+	send_raw_rect(vcs, x, y, w, h);
+    }
+}
+
+static int corre_rect_count(int w, int h)
+{
+    return ((w + CORRE_MAX_RECT_SIZE - 1) / CORRE_MAX_RECT_SIZE) *
+	((h + CORRE_MAX_RECT_SIZE - 1) / CORRE_MAX_RECT_SIZE);
+}
+
+static void send_corre_rect(struct VncClientState *vcs, int x, int y,
+			    int w, int h)
+{
+    int i, j;
+
+    for (j = 0; j < h; j += CORRE_MAX_RECT_SIZE)
+	for (i = 0; i < w; i += CORRE_MAX_RECT_SIZE)
+	    send_rre_rect(vcs, x + i, y + j, MIN(CORRE_MAX_RECT_SIZE, w - i),
+			  MIN(CORRE_MAX_RECT_SIZE, h - j), VNC_ENCODING_CORRE);
+}
+
+/* find or create the tile cache for the client's pixel format */
+static struct hextile_cache *vnc_hextile_cache_get(struct VncClientState *vcs)
+{
+    struct VncState *vs = vcs->vs;
+    struct hextile_cache *hc;
+    int i, slot = -1;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	hc = vs->hextile_caches[i];
+	if (hc == NULL) {
+	    if (slot == -1)
+		slot = i;
+	    continue;
+	}
+	if (hc->pix_bpp == vcs->pix_bpp &&
+	    hc->pix_big_endian == vcs->pix_big_endian &&
+	    hc->red_shift == vcs->red_shift && hc->red_max == vcs->red_max &&
+	    hc->green_shift == vcs->green_shift &&
+	    hc->green_max == vcs->green_max &&
+	    hc->blue_shift == vcs->blue_shift &&
+	    hc->blue_max == vcs->blue_max) {
+	    hc->refs++;
+	    return hc;
+	}
+    }
+    if (slot == -1)
+	return NULL;
+
+    hc = calloc(1, sizeof(struct hextile_cache));
+    if (hc == NULL)
+	return NULL;
+    hc->pix_bpp = vcs->pix_bpp;
+    hc->pix_big_endian = vcs->pix_big_endian;
+    hc->red_shift = vcs->red_shift;
+    hc->red_max = vcs->red_max;
+    hc->green_shift = vcs->green_shift;
+    hc->green_max = vcs->green_max;
+    hc->blue_shift = vcs->blue_shift;
+    hc->blue_max = vcs->blue_max;
+    hc->refs = 1;
+    vs->hextile_caches[slot] = hc;
+    return hc;
+}
+
+static void vnc_hextile_cache_release(struct VncClientState *vcs)
+{
+    struct VncState *vs = vcs->vs;
+    struct hextile_cache *hc = vcs->hextile_cache;
+    struct hextile_cache_entry *e;
+    int i;
+
+    if (hc == NULL)
+	return;
+    vcs->hextile_cache = NULL;
+    if (--hc->refs)
+	return;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+	if (vs->hextile_caches[i] == hc)
+	    vs->hextile_caches[i] = NULL;
+    while (hc->lru_first) {
+	e = hc->lru_first;
+	hc->lru_first = e->lru_next;
+	free(e->pixels);
+	free(e);
+    }
+    free(hc);
+}
+
+static uint32_t hextile_tile_hash(uint8_t *data, int stride, int len, int h)
+{
+    uint32_t hash = 2166136261U ^ (len << 8) ^ h;
+    uint32_t v;
+    int i, j;
+
+    for (j = 0; j < h; j++) {
+	for (i = 0; i + 4 <= len; i += 4) {
+	    memcpy(&v, data + i, 4);
+	    hash = (hash ^ v) * 16777619U;
+	}
+	for (; i < len; i++)
+	    hash = (hash ^ data[i]) * 16777619U;
+	data += stride;
+    }
+    return hash;
+}
+
+static struct hextile_cache_entry *
+hextile_cache_lookup(struct hextile_cache *hc, uint32_t hash, uint8_t *data,
+		     int stride, int len, int w, int h)
+{
+    struct hextile_cache_entry *e;
+    int j;
+
+    for (e = hc->hash[hash % HEXTILE_CACHE_HASH]; e; e = e->hash_next) {
+	if (e->hash != hash || e->w != w || e->h != h)
+	    continue;
+	for (j = 0; j < h; j++)
+	    if (memcmp(e->pixels + j * len, data + j * stride, len))
+		break;
+	if (j == h)
+	    return e;
+    }
+    return NULL;
+}
+
+static void hextile_cache_unlink(struct hextile_cache *hc,
+				 struct hextile_cache_entry *e)
+{
+    if (e->lru_prev)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	hc->lru_first = e->lru_next;
+    if (e->lru_next)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	hc->lru_last = e->lru_prev;
+}
+
+static void hextile_cache_link(struct hextile_cache *hc,
+			       struct hextile_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = hc->lru_first;
+    if (hc->lru_first)
+	hc->lru_first->lru_prev = e;
+    else
+	hc->lru_last = e;
+    hc->lru_first = e;
+}
+
+/* Remember the tile that was just written to the output, starting at
+   offset.  last_bg and last_fg hold the tile's background and
+   foreground unless it was sent raw. */
+static void hextile_cache_insert(struct VncClientState *vcs, uint32_t hash,
+				 uint8_t *data, int stride, int w, int h,
+				 size_t offset, void *last_bg, void *last_fg)
+{
+    struct VncState *vs = vcs->vs;
+    struct hextile_cache *hc = vcs->hextile_cache;
+    struct hextile_cache_entry *e, **pe;
+    uint8_t *out = vcs->output.buffer + offset;
+    int len = w * vs->depth;
+    int j, n_data, header = 1;
+
+    if (!(out[0] & 0x01)) {
+	if (out[0] & 0x02)
+	    header += vcs->pix_bpp;
+	if (out[0] & 0x04)
+	    header += vcs->pix_bpp;
+    }
+    n_data = vcs->output.offset - offset - header;
+
+    if (hc->n_entries == HEXTILE_CACHE_SIZE) {
+	e = hc->lru_last;
+	hextile_cache_unlink(hc, e);
+	for (pe = &hc->hash[e->hash % HEXTILE_CACHE_HASH]; *pe != e;
+	     pe = &(*pe)->hash_next)
+	    ;
+	*pe = e->hash_next;
+	hc->evictions++;
+    } else {
+	e = calloc(1, sizeof(struct hextile_cache_entry));
+	if (e == NULL)
+	    return;
+	vs->update_allocs++;
+	hc->n_entries++;
+    }
+
+    /* an evicted entry keeps its pixels if they are big enough */
+    if (e->size < len * h + n_data) {
+	free(e->pixels);
+	e->size = len * h + n_data;
+	e->pixels = malloc(e->size);
+	if (e->pixels == NULL) {
+	    free(e);
+	    hc->n_entries--;
+	    return;
+	}
+	vs->update_allocs++;
+    }
+    for (j = 0; j < h; j++)
+	memcpy(e->pixels + j * len, data + j * stride, len);
+    memcpy(e->pixels + len * h, out + header, n_data);
+    e->n_data = n_data;
+    e->hash = hash;
+    e->w = w;
+    e->h = h;
+    e->flags = out[0] & ~0x06;
+    if (!(e->flags & 0x01)) {
+	memcpy(e->bg, last_bg, vs->depth);
+	memcpy(e->fg, last_fg, vs->depth);
+    }
+
+    e->hash_next = hc->hash[hash % HEXTILE_CACHE_HASH];
+    hc->hash[hash % HEXTILE_CACHE_HASH] = e;
+    hextile_cache_link(hc, e);
+}
+
+/* send a tile from the cache, with the same bytes and effect on the
+   bg/fg state that the encoder would have had */
+static void hextile_cache_send(struct VncClientState *vcs,
+			       struct hextile_cache_entry *e,
+			       void *last_bg, void *last_fg,
+			       int *has_bg, int *has_fg)
+{
+    struct VncState *vs = vcs->vs;
+    uint8_t *p = buffer_end(&vcs->output);
+    int flags = e->flags;
+
+    if (flags & 0x01) {
+	*has_bg = 0;
+	*has_fg = 0;
+	*p++ = flags;
+    } else {
+	if (!*has_bg || memcmp(last_bg, e->bg, vs->depth)) {
+	    flags |= 0x02;
+	    *has_bg = 1;
+	    memcpy(last_bg, e->bg, vs->depth);
+	}
+	if (!*has_fg || memcmp(last_fg, e->fg, vs->depth)) {
+	    flags |= 0x04;
+	    *has_fg = 1;
+	    memcpy(last_fg, e->fg, vs->depth);
+	}
+	*p++ = flags;
+	if (flags & 0x02) {
+	    vnc_pixel_to_client(vcs, p, vnc_pixel_value(vs, e->bg));
+	    p += vcs->pix_bpp;
+	}
+	if (flags & 0x04) {
+	    vnc_pixel_to_client(vcs, p, vnc_pixel_value(vs, e->fg));
+	    p += vcs->pix_bpp;
+	}
+	/* a SubrectsColoured tile invalidates the foreground */
+	if (flags & 0x10)
+	    *has_fg = 0;
+    }
+    memcpy(p, e->pixels + e->w * e->h * vs->depth, e->n_data);
+    vcs->output.offset = p + e->n_data - vcs->output.buffer;
+}
+
+static void send_hextile_tile_cached(struct VncClientState *vcs,
+				     uint8_t *data, int stride, int w, int h,
+				     void *last_bg, void *last_fg,
+				     int *has_bg, int *has_fg)
+{
+    struct VncState *vs = vcs->vs;
+    struct hextile_cache *hc = vcs->hextile_cache;
+    struct hextile_cache_entry *e;
+    uint32_t hash;
+    size_t offset;
+
+    hash = hextile_tile_hash(data, stride, w * vs->depth, h);
+    e = hextile_cache_lookup(hc, hash, data, stride, w * vs->depth, w, h);
+    if (e) {
+	hc->hits++;
+	hextile_cache_unlink(hc, e);
+	hextile_cache_link(hc, e);
+	hextile_cache_send(vcs, e, last_bg, last_fg, has_bg, has_fg);
+	return;
+    }
+
+    hc->misses++;
+    offset = vcs->output.offset;
+    vcs->send_hextile_tile(vcs, data, stride, w, h, last_bg, last_fg,
+			   has_bg, has_fg);
+    hextile_cache_insert(vcs, hash, data, stride, w, h, offset,
+			 last_bg, last_fg);
+}
+
+/* upper bound of the bucket holding the given fraction of samples */
+static uint64_t vnc_latency_percentile(struct vnc_latency *l, double p)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < VNC_LATENCY_BUCKETS - 1; i++) {
+	n += l->buckets[i];
+	if (n >= p * l->count)
+	    break;
+    }
+    return MIN(2ULL << i, l->max);
+}
+
+static void vnc_dpy_dump_stats(DisplayState *ds, FILE *f)
+{
+    VncState *vs = ds->opaque;
+    struct hextile_cache *hc;
+    uint64_t lookups;
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	hc = vs->hextile_caches[i];
+	if (hc == NULL)
+	    continue;
+	lookups = hc->hits + hc->misses;
+	fprintf(f, "vnc: hextile cache %dbpp (%d clients): %d entries, "
+		"%llu hits, %llu misses (%.1f%% hit), %llu evictions\n",
+		hc->pix_bpp * 8, hc->refs, hc->n_entries,
+		(unsigned long long)hc->hits, (unsigned long long)hc->misses,
+		lookups ? 100.0 * hc->hits / lookups : 0.0,
+		(unsigned long long)hc->evictions);
+    }
+    fprintf(f, "vnc: shadow framebuffer: %llu of %llu dirty bytes "
+	    "unchanged\n", (unsigned long long)vs->shadow_unchanged,
+	    (unsigned long long)vs->shadow_compared);
+    fprintf(f, "vnc: shared updates: %llu encoded, %llu reused\n",
+	    (unsigned long long)vs->shared_encoded,
+	    (unsigned long long)vs->shared_reused);
+    fprintf(f, "vnc: backlog: %llu region updates deferred, %llu dirty "
+	    "tiles superseded\n", (unsigned long long)vs->updates_deferred,
+	    (unsigned long long)vs->tiles_superseded);
+    fprintf(f, "vnc: heap allocations: %llu for updates, %llu buffer "
+	    "growths, none in the last %d updates\n",
+	    (unsigned long long)vs->update_allocs,
+	    (unsigned long long)buffer_reallocs, vs->alloc_free_updates);
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	struct vnc_latency *l;
+
+	if (!VCS_INUSE(vs->vcs[i]))
+	    continue;
+	l = &vs->vcs[i]->latency;
+	fprintf(f, "vnc: client %d output latency: %llu updates, "
+		"p50 %lluus, p99 %lluus, max %lluus\n", i,
+		(unsigned long long)l->count,
+		(unsigned long long)vnc_latency_percentile(l, 0.5),
+		(unsigned long long)vnc_latency_percentile(l, 0.99),
+		(unsigned long long)l->max);
+    }
+}
+
+static void send_hextile_rect(struct VncClientState *vcs, int x, int y,
+			      int w, int h)
+{
+    struct VncState *vs = vcs->vs;
+    int i, j, stride;
+    uint8_t *row;
+    int has_fg, has_bg;
+    uint32_t last_fg, last_bg;
+
+    if (vcs->hextile_cache == NULL)
+	vcs->hextile_cache = vnc_hextile_cache_get(vcs);
+
+    row = vs->ds->data + y * vs->ds->linesize + x * vs->depth;
+    stride = vs->ds->linesize;
+    has_fg = has_bg = 0;
+    for (j = 0; j < h; j += 16) {
+	buffer_reserve(&vcs->output, ((w + 15) / 16) *
+		       HEXTILE_MAX_TILE_SIZE(vcs->pix_bpp));
+	for (i = 0; i < w; i += 16) {
+	    if (vcs->hextile_cache)
+		send_hextile_tile_cached(vcs, row + i * vs->depth, stride,
+					 MIN(16, w - i), MIN(16, h - j),
+					 &last_bg, &last_fg, &has_bg, &has_fg);
+	    else
+		vcs->send_hextile_tile(vcs, row + i * vs->depth, stride,
+				       MIN(16, w - i), MIN(16, h - j),
+				       &last_bg, &last_fg, &has_bg, &has_fg);
+	}
+	row += 16 * stride;
+    }
+}
+
+static int vnc_zrle_init(struct VncClientState *vcs)
+{
+    if (vcs->zrle_stream_active)
+	return 0;
+
+    memset(&vcs->zrle_stream, 0, sizeof(vcs->zrle_stream));
+    if (deflateInit(&vcs->zrle_stream, ZRLE_COMPRESSION) != Z_OK) {
+	fprintf(stderr, "vnc: zlib initialisation failed\n");
+	return -1;
+    }
+    vcs->zrle_stream_active = 1;
+    return 0;
+}
+
+static void vnc_zrle_reset(struct VncClientState *vcs)
+{
+    if (vcs->zrle_stream_active) {
+	deflateEnd(&vcs->zrle_stream);
+	vcs->zrle_stream_active = 0;
+    }
+    buffer_reset(&vcs->zrle);
+}
+
+/* compress all of in and append it to out, flushed to a byte boundary
+   so that the client can decode it without further data */
+static void vnc_deflate(z_stream *zs, Buffer *in, Buffer *out)
+{
+    zs->next_in = in->buffer;
+    zs->avail_in = in->offset;
+    do {
+	buffer_reserve(out, zs->avail_in + 64);
+	zs->next_out = buffer_end(out);
+	zs->avail_out = out->capacity - out->offset;
+	if (deflate(zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+	    fprintf(stderr, "vnc: zlib compression failed\n");
+	    exit(1);
+	}
+	out->offset = out->capacity - zs->avail_out;
+    } while (zs->avail_out == 0);
+}
+
+/* compress the tile data in vcs->zrle into the output buffer, preceded
+   by its length */
+static void vnc_zrle_flush(struct VncClientState *vcs)
+{
+    size_t len_offset;
+    uint32_t len;
+
+    len_offset = vcs->output.offset;
+    vnc_write_u32(vcs, 0);
+
+    vnc_deflate(&vcs->zrle_stream, &vcs->zrle, &vcs->output);
+
+    len = htonl(vcs->output.offset - len_offset - 4);
+    memcpy(vcs->output.buffer + len_offset, &len, 4);
+    buffer_reset(&vcs->zrle);
+}
+
+/* encode the tiles of a rectangle into vcs->zrle */
+static void zrle_encode_rect(struct VncClientState *vcs, int x, int y,
+			     int w, int h)
+{
+    struct VncState *vs = vcs->vs;
+    int i, j, stride;
+    uint8_t *row;
+
+    row = vs->ds->data + y * vs->ds->linesize + x * vs->depth;
+    stride = vs->ds->linesize;
+    buffer_reset(&vcs->zrle);
+    for (j = 0; j < h; j += ZRLE_TILE_SIZE) {
+	for (i = 0; i < w; i += ZRLE_TILE_SIZE) {
+	    int tw = MIN(ZRLE_TILE_SIZE, w - i);
+	    int th = MIN(ZRLE_TILE_SIZE, h - j);
+	    uint8_t *tile = row + i * vs->depth;
+
+	    switch (vs->depth) {
+	    case 1:
+		send_zrle_tile_8(vcs, tile, stride, tw, th);
+		break;
+	    case 2:
+		send_zrle_tile_16(vcs, tile, stride, tw, th);
+		break;
+	    default:
+	    case 4:
+		send_zrle_tile_32(vcs, tile, stride, tw, th);
+		break;
+	    }
+	}
+	row += ZRLE_TILE_SIZE * stride;
+    }
+}
+
+static void send_zrle_rect(struct VncClientState *vcs, int x, int y,
+			   int w, int h)
+{
+    zrle_encode_rect(vcs, x, y, w, h);
+    vnc_zrle_flush(vcs);
+}
+
+static void vnc_tight_reset(struct VncClientState *vcs)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+	if (vcs->tight_stream_active & (1 << i))
+	    deflateEnd(&vcs->tight_stream[i]);
+    vcs->tight_stream_active = 0;
+    vcs->tight_reset = 0;
+    vcs->tight_level = TIGHT_DEFAULT_COMPRESSION;
+    buffer_reset(&vcs->tight);
+    buffer_reset(&vcs->tight_zlib);
+}
+
+/* A new compression level only applies to fresh streams: drop the
+   current ones and have the client reset its side with the next
+   rectangle. */
+static void vnc_tight_set_level(struct VncClientState *vcs, int level)
+{
+    int i;
+
+    if (level == vcs->tight_level)
+	return;
+
+    for (i = 0; i < 4; i++)
+	if (vcs->tight_stream_active & (1 << i))
+	    deflateEnd(&vcs->tight_stream[i]);
+    vcs->tight_reset |= vcs->tight_stream_active;
+    vcs->tight_stream_active = 0;
+    vcs->tight_level = level;
+}
+
+static void tight_palette_reset(struct VncClientState *vcs)
+{
+    vcs->tight_palette.n_colors = 0;
+    memset(vcs->tight_palette.hash, 0, sizeof(vcs->tight_palette.hash));
+}
+
+static inline unsigned int tight_palette_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> 23;	/* 9 bits: TIGHT_PALETTE_HASH */
+}
+
+static int tight_palette_lookup(struct VncClientState *vcs, uint32_t v)
+{
+    struct tight_palette *pal = &vcs->tight_palette;
+    unsigned int h = tight_palette_hash(v);
+
+    while (pal->hash[h]) {
+	if (pal->colors[pal->hash[h] - 1] == v)
+	    return pal->hash[h] - 1;
+	h = (h + 1) % TIGHT_PALETTE_HASH;
+    }
+    return -1;
+}
+
+/* returns the colour's index, or -1 if the palette is full */
+static int tight_palette_insert(struct VncClientState *vcs, uint32_t v,
+				int max_colors)
+{
+    struct tight_palette *pal = &vcs->tight_palette;
+    unsigned int h = tight_palette_hash(v);
+
+    while (pal->hash[h]) {
+	if (pal->colors[pal->hash[h] - 1] == v)
+	    return pal->hash[h] - 1;
+	h = (h + 1) % TIGHT_PALETTE_HASH;
+    }
+    if (pal->n_colors == max_colors)
+	return -1;
+    pal->colors[pal->n_colors] = v;
+    pal->hash[h] = ++pal->n_colors;
+    return pal->n_colors - 1;
+}
+
+/* TPIXEL: a client pixel, or just its R, G and B bytes for 24-bit
+   colour in a 32-bit pixel.  Returns the size written to buf. */
+static int tight_pixel_to_client(struct VncClientState *vcs, uint8_t *buf,
+				 uint32_t v)
+{
+    uint32_t p;
+
+    vnc_pixel_to_client(vcs, buf, v);
+    if (vcs->tight_tpixel_size != 3)
+	return vcs->tight_tpixel_size;
+
+    if (vcs->pix_big_endian)
+	p = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    else
+	p = (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+    buf[0] = p >> vcs->red_shift;
+    buf[1] = p >> vcs->green_shift;
+    buf[2] = p >> vcs->blue_shift;
+    return 3;
+}
+
+static void tight_put_tpixel(struct VncClientState *vcs, Buffer *buffer,
+			     uint32_t v)
+{
+    uint8_t buf[4];
+    int n;
+
+    n = tight_pixel_to_client(vcs, buf, v);
+    buffer_reserve(buffer, n);
+    buffer_append(buffer, buf, n);
+}
+
+#define BPP 8
+#include "vnctight.h"
+#undef BPP
+
+#define BPP 16
+#include "vnctight.h"
+#undef BPP
+
+#define BPP 32
+#include "vnctight.h"
+#undef BPP
+
+/* send the filtered data in vcs->tight, compressed with the given
+   stream unless it is too short to be worth it */
+static void tight_compress(struct VncClientState *vcs, int stream)
+{
+    z_stream *zs = &vcs->tight_stream[stream];
+    size_t len;
+
+    if (vcs->tight.offset < TIGHT_MIN_TO_COMPRESS) {
+	vnc_write(vcs, vcs->tight.buffer, vcs->tight.offset);
+	return;
+    }
+
+    if (!(vcs->tight_stream_active & (1 << stream))) {
+	memset(zs, 0, sizeof(*zs));
+	if (deflateInit(zs, vcs->tight_level) != Z_OK) {
+	    fprintf(stderr, "vnc: zlib initialisation failed\n");
+	    exit(1);
+	}
+	vcs->tight_stream_active |= 1 << stream;
+    }
+
+    buffer_reset(&vcs->tight_zlib);
+    vnc_deflate(zs, &vcs->tight, &vcs->tight_zlib);
+
+    /* compact length: 7 bits per byte, 3 bytes at most */
+    len = vcs->tight_zlib.offset;
+    if (len < 0x80) {
+	vnc_write_u8(vcs, len);
+    } else if (len < 0x4000) {
+	vnc_write_u8(vcs, (len & 0x7f) | 0x80);
+	vnc_write_u8(vcs, len >> 7);
+    } else {
+	vnc_write_u8(vcs, (len & 0x7f) | 0x80);
+	vnc_write_u8(vcs, ((len >> 7) & 0x7f) | 0x80);
+	vnc_write_u8(vcs, len >> 14);
+    }
+    vnc_write(vcs, vcs->tight_zlib.buffer, len);
+}
+
+static void send_tight_subrect(struct VncClientState *vcs, int x, int y,
+			       int w, int h)
+{
+    struct VncState *vs = vcs->vs;
+    struct tight_palette *pal = &vcs->tight_palette;
+    int i, stride, n_colors, control, stream, tpb;
+    uint8_t *row;
+    uint8_t buf[4];
+
+    row = vs->ds->data + y * vs->ds->linesize + x * vs->depth;
+    stride = vs->ds->linesize;
+
+    vnc_framebuffer_update(vcs, x, y, w, h, VNC_ENCODING_TIGHT);
+
+    switch (vs->depth) {
+    case 1:
+	n_colors = tight_fill_palette_8(vcs, row, stride, w, h,
+					TIGHT_MAX_PALETTE);
+	break;
+    case 2:
+	n_colors = tight_fill_palette_16(vcs, row, stride, w, h,
+					 TIGHT_MAX_PALETTE);
+	break;
+    default:
+    case 4:
+	n_colors = tight_fill_palette_32(vcs, row, stride, w, h,
+					 TIGHT_MAX_PALETTE);
+	break;
+    }
+
+    control = vcs->tight_reset;
+    vcs->tight_reset = 0;
+    tpb = vcs->tight_tpixel_size;
+    buffer_reset(&vcs->tight);
+
+    if (n_colors == 1) {
+	/* fill */
+	vnc_write_u8(vcs, control | 0x80);
+	vnc_write(vcs, buf, tight_pixel_to_client(vcs, buf, pal->colors[0]));
+    } else if (n_colors && (n_colors == 2 ||
+			    n_colors * tpb + w * h < w * h * tpb)) {
+	/* palette filter, one bit per pixel for mono rectangles */
+	stream = n_colors == 2 ? TIGHT_STREAM_MONO : TIGHT_STREAM_INDEXED;
+	vnc_write_u8(vcs, control | (stream << 4) | 0x40);
+	vnc_write_u8(vcs, 1);
+	vnc_write_u8(vcs, n_colors - 1);
+	for (i = 0; i < n_colors; i++)
+	    vnc_write(vcs, buf, tight_pixel_to_client(vcs, buf,
+						      pal->colors[i]));
+	switch (vs->depth) {
+	case 1:
+	    tight_encode_indexed_8(vcs, row, stride, w, h);
+	    break;
+	case 2:
+	    tight_encode_indexed_16(vcs, row, stride, w, h);
+	    break;
+	default:
+	case 4:
+	    tight_encode_indexed_32(vcs, row, stride, w, h);
+	    break;
+	}
+	tight_compress(vcs, stream);
+    } else {
+	/* copy filter */
+	vnc_write_u8(vcs, control | (TIGHT_STREAM_FULL << 4));
+	switch (vs->depth) {
+	case 1:
+	    tight_encode_full_8(vcs, row, stride, w, h);
+	    break;
+	case 2:
+	    tight_encode_full_16(vcs, row, stride, w, h);
+	    break;
+	default:
+	case 4:
+	    tight_encode_full_32(vcs, row, stride, w, h);
+	    break;
+	}
+	tight_compress(vcs, TIGHT_STREAM_FULL);
+    }
+}
+
+/* Tight splits regions into columns at most TIGHT_MAX_RECT_WIDTH wide,
+   cut into strips of at most TIGHT_MAX_RECT_SIZE pixels */
+static int tight_rect_count(int w, int h)
+{
+    int i, cw, sh, n = 0;
+
+    for (i = 0; i < w; i += TIGHT_MAX_RECT_WIDTH) {
+	cw = MIN(TIGHT_MAX_RECT_WIDTH, w - i);
+	sh = TIGHT_MAX_RECT_SIZE / cw;
+	n += (h + sh - 1) / sh;
+    }
+    return n;
+}
+
+static void send_tight_rect(struct VncClientState *vcs, int x, int y,
+			    int w, int h)
+{
+    int i, j, cw, sh;
+
+    for (i = 0; i < w; i += TIGHT_MAX_RECT_WIDTH) {
+	cw = MIN(TIGHT_MAX_RECT_WIDTH, w - i);
+	sh = TIGHT_MAX_RECT_SIZE / cw;
+	for (j = 0; j < h; j += sh)
+	    send_tight_subrect(vcs, x + i, y + j, cw, MIN(sh, h - j));
+    }
+}
+
+/* number of rectangles send_framebuffer_rect uses for a region, for
+   clients that need the count to fit the update header */
+static int vnc_rect_count(struct VncClientState *vcs, int w, int h)
+{
+    if (vcs->encoding == VNC_ENCODING_TIGHT)
+	return tight_rect_count(w, h);
+    if (vcs->encoding == VNC_ENCODING_CORRE)
+	return corre_rect_count(w, h);
+    return 1;
+}
+
+static void send_framebuffer_rect(struct VncClientState *vcs, int x, int y,
+				  int w, int h)
+{
+    switch (vcs->encoding) {
+    case VNC_ENCODING_HEXTILE:
+	vnc_framebuffer_update(vcs, x, y, w, h, VNC_ENCODING_HEXTILE);
+	send_hextile_rect(vcs, x, y, w, h);
+	break;
+    case VNC_ENCODING_TIGHT:
+	send_tight_rect(vcs, x, y, w, h);
+	break;
+    case VNC_ENCODING_RRE:
+	send_rre_rect(vcs, x, y, w, h, VNC_ENCODING_RRE);
+	break;
+    case VNC_ENCODING_CORRE:
+	send_corre_rect(vcs, x, y, w, h);
+	break;
+    case VNC_ENCODING_ZRLE:
+	vnc_framebuffer_update(vcs, x, y, w, h, VNC_ENCODING_ZRLE);
+	send_zrle_rect(vcs, x, y, w, h);
+	break;
+    default:
+	vnc_framebuffer_update(vcs, x, y, w, h, VNC_ENCODING_RAW);
+	send_raw_rect(vcs, x, y, w, h);
+	break;
+    }
+}
+
+/* Tight output depends on the state of the client's compression
+   streams all the way through, so it is never shared. */
+static int vnc_can_share(struct VncClientState *vcs)
+{
+    return vcs->encoding == VNC_ENCODING_RAW ||
+	vcs->encoding == VNC_ENCODING_RRE ||
+	vcs->encoding == VNC_ENCODING_CORRE ||
+	vcs->encoding == VNC_ENCODING_HEXTILE ||
+	vcs->encoding == VNC_ENCODING_ZRLE;
+}
+
+static int vnc_same_format(struct VncClientState *a, struct VncClientState *b)
+{
+    return a->pix_bpp == b->pix_bpp &&
+	a->pix_big_endian == b->pix_big_endian &&
+	a->red_shift == b->red_shift && a->red_max == b->red_max &&
+	a->green_shift == b->green_shift && a->green_max == b->green_max &&
+	a->blue_shift == b->blue_shift && a->blue_max == b->blue_max &&
+	a->zrle_cpixel_size == b->zrle_cpixel_size;
+}
+
+/* The shared encoding is stale once the framebuffer has been copied or
+   resized, or the region has been drawn to since it was queued. */
+static int vnc_shared_rect_valid(VncState *vs, struct vnc_shared_rect *sr,
+				 int x, int y, int w, int h)
+{
+    return sr->generation == vs->generation &&
+	!vnc_dirty_test(vs, &vs->update, x, y, w, h);
+}
 
-    for (i = 0; i < sizeof(cursorbmsk); i++) {
-        for (j = 0; j < 8; j++) {
-            if (cursorbmsk[i] & (1 << (8 - j)))
-                writeGrey(vcs, &cur);
-            else
-                writeZero(vcs, &cur);
-        }
-    }
+/* send a region update, reusing its shared encoding if another client
+   has already produced it */
+static void send_region_update(struct VncClientState *vcs,
+			       struct vnc_pm_region_update *rup)
+{
+    struct VncState *vs = vcs->vs;
+    struct vnc_shared_rect *sr = rup->shared;
+    size_t offset;
+    int n_rects;
 
-    vnc_write_u16(vcs, 0);
-    vnc_write_u16(vcs, 1); /* number of rects */
+    if (sr == NULL ||
+	!vnc_shared_rect_valid(vs, sr, rup->x, rup->y, rup->w, rup->h)) {
+	send_framebuffer_rect(vcs, rup->x, rup->y, rup->w, rup->h);
+	return;
+    }
 
-    /* width 8, height - number of bytes in mask, hotspot in the middle */
-    vnc_framebuffer_update(vcs, 8 / 2, sizeof(cursorbmsk) / 2, 8,
-               sizeof(cursorbmsk), -239);
-    vnc_write_pixels_copy(vcs, cursorcur, size);
-    vnc_write(vcs, cursorbmsk, sizeof(cursorbmsk));
+    if (sr->encoded)
+	vs->shared_reused++;
+    else
+	vs->shared_encoded++;
+
+    /* ZRLE clients each have their own deflate stream, so only the
+       tile data is shared */
+    if (vcs->encoding == VNC_ENCODING_ZRLE) {
+	vnc_framebuffer_update(vcs, rup->x, rup->y, rup->w, rup->h,
+			       VNC_ENCODING_ZRLE);
+	if (sr->encoded) {
+	    buffer_reset(&vcs->zrle);
+	    buffer_reserve(&vcs->zrle, sr->data.offset);
+	    buffer_append(&vcs->zrle, sr->data.buffer, sr->data.offset);
+	} else {
+	    zrle_encode_rect(vcs, rup->x, rup->y, rup->w, rup->h);
+	    buffer_reserve(&sr->data, vcs->zrle.offset);
+	    buffer_append(&sr->data, vcs->zrle.buffer, vcs->zrle.offset);
+	    sr->encoded = 1;
+	}
+	vnc_zrle_flush(vcs);
+	return;
+    }
 
-    free(cursorcur);
+    if (sr->encoded) {
+	vnc_write(vcs, sr->data.buffer, sr->data.offset);
+	vcs->update_rects += sr->n_rects;
+	return;
+    }
+    offset = vcs->output.offset;
+    n_rects = vcs->update_rects;
+    send_framebuffer_rect(vcs, rup->x, rup->y, rup->w, rup->h);
+    buffer_reserve(&sr->data, vcs->output.offset - offset);
+    buffer_append(&sr->data, vcs->output.buffer + offset,
+		  vcs->output.offset - offset);
+    sr->n_rects = vcs->update_rects - n_rects;
+    sr->encoded = 1;
 }
 
-static void vnc_dpy_copy_rect(DisplayState *ds, int xf, int yf, int xt, int yt, int w, int h)
+/* Queue a region update for each of a set of clients.  Clients using
+   the same pixel format and encoding share a single encoding of it. */
+static void send_framebuffer_update(VncState *vs, unsigned int clients,
+				    int x, int y, int w, int h)
 {
-    struct VncState *vs = ds->opaque;
+    struct vnc_pm_region_update *rups[MAX_CLIENTS];
+    struct vnc_shared_rect *sr;
     struct VncClientState *vcs;
-    int i;
-
-    dprintf("sending copy rect. %d,%d->%d,%d [%d,%d]\n", xf, yf, xt, yt, w, h);
+    int i, j;
 
     for (i = 0; i < MAX_CLIENTS; i++) {
-	if (!VCS_ACTIVE(vs->vcs[i]))
+	rups[i] = NULL;
+	if (!(clients & (1U << i)) || !VCS_ACTIVE(vs->vcs[i]))
 	    continue;
-	
 	vcs = vs->vcs[i];
 
-	vnc_write_u16(vcs, 0);
-	vnc_write_u16(vcs, 1); /* number of rects */
-	
-	/* width 8, height - number of bytes in mask, hotspot in the middle */
-	vnc_framebuffer_update(vcs, xt, yt, w, h, 1);
-	vnc_write_u16(vcs, xf); /* src X */
-	vnc_write_u16(vcs, yf); /* src Y */
+	rups[i] = vnc_queue_region_update(vcs, x, y, w, h);
+	if (rups[i] == NULL || !vnc_can_share(vcs))
+	    continue;
+
+	for (j = 0; j < i; j++) {
+	    if (rups[j] == NULL || vs->vcs[j]->encoding != vcs->encoding ||
+		!vnc_same_format(vs->vcs[j], vcs))
+		continue;
+	    sr = rups[j]->shared;
+	    if (sr == NULL) {
+		sr = vnc_shared_rect_get(vs);
+		if (sr == NULL)
+		    break;
+		sr->refs = 1;
+		sr->generation = vs->generation;
+		rups[j]->shared = sr;
+	    }
+	    sr->refs++;
+	    rups[i]->shared = sr;
+	    break;
+	}
+    }
+}
+
+/* Whether tile (tx, ty) differs from the shadow, which is brought up
+   to date with it; refreshed tiles count as different regardless. */
+static int vnc_shadow_tile(VncState *vs, int tx, int ty, int refresh)
+{
+    int x = T2X(tx), y = T2X(ty);
+    int len = MIN(VNC_TILE_SIZE, vs->ds->width - x) * vs->depth;
+    int h = MIN(VNC_TILE_SIZE, vs->ds->height - y);
+    size_t offset = y * vs->ds->linesize + x * vs->depth;
+    int j, changed = refresh;
+
+    for (j = 0; j < h; j++, offset += vs->ds->linesize) {
+	if (!changed &&
+	    memcmp(vs->ds->data + offset, vs->shadow + offset, len) == 0)
+	    continue;
+	changed = 1;
+	memcpy(vs->shadow + offset, vs->ds->data + offset, len);
     }
 
+    if (!refresh) {
+	vs->shadow_compared += len * h;
+	if (!changed)
+	    vs->shadow_unchanged += len * h;
+    }
+    return changed;
 }
 
-static void hextile_enc_cord(uint8_t *ptr, int x, int y, int w, int h)
+/* A client sending an update for pixels that have changed again since
+   they were queued may get something other than the shadow: make sure
+   those changes get to it even if they end up undone. */
+static void vnc_shadow_sent(VncState *vs, int x, int y, int w, int h)
 {
-    ptr[0] = ((x & 0x0F) << 4) | (y & 0x0F);
-    ptr[1] = (((w - 1) & 0x0F) << 4) | ((h - 1) & 0x0F);
+    uint64_t *row, bits;
+    int tx1, tx2, ty, ty2, i;
+
+    tx1 = X2T_DOWN(x);
+    tx2 = MIN(X2T_UP(x + w), vs->tile_cols);
+    ty2 = MIN(X2T_UP(y + h), vs->tile_rows);
+    if (tx1 >= tx2)
+	return;
+    for (ty = X2T_DOWN(y); ty < ty2; ty++) {
+	if (!(vs->update.rows[ty / 64] & (1ULL << (ty % 64))))
+	    continue;
+	row = vnc_dirty_row(vs, &vs->update, ty);
+	for (i = tx1 / 64; i <= (tx2 - 1) / 64; i++) {
+	    bits = row[i] & bits_in_word(i, tx1, tx2);
+	    if (bits) {
+		vnc_dirty_row(vs, &vs->refresh, ty)[i] |= bits;
+		vs->refresh.rows[ty / 64] |= 1ULL << (ty % 64);
+	    }
+	}
+    }
 }
 
-#define BPP 8
-#include "vnchextile.h"
-#undef BPP
+/* A region update gets the framebuffer as it is when sent, so it also
+   covers anything that has since become outstanding for the client in
+   the tiles it spans entirely. */
+static void vnc_update_sent(struct VncClientState *vcs, int x, int y,
+			    int w, int h)
+{
+    struct VncState *vs = vcs->vs;
+    uint64_t *row, mask;
+    int tx1, tx2, ty, ty2, i;
 
-#define BPP 16
-#include "vnchextile.h"
-#undef BPP
+    vnc_shadow_sent(vs, x, y, w, h);
 
-#define BPP 32
-#include "vnchextile.h"
-#undef BPP
+    tx1 = X2T_UP(x);
+    tx2 = x + w >= vs->ds->width ? vs->tile_cols : X2T_DOWN(x + w);
+    ty2 = y + h >= vs->ds->height ? vs->tile_rows : X2T_DOWN(y + h);
+    if (tx1 >= tx2)
+	return;
+    for (ty = X2T_UP(y); ty < ty2; ty++) {
+	if (!(vcs->update.rows[ty / 64] & (1ULL << (ty % 64))))
+	    continue;
+	row = vnc_dirty_row(vs, &vcs->update, ty);
+	for (i = tx1 / 64; i <= (tx2 - 1) / 64; i++) {
+	    mask = bits_in_word(i, tx1, tx2);
+	    vs->tiles_superseded += __builtin_popcountll(row[i] & mask);
+	    row[i] &= ~mask;
+	}
+	vnc_dirty_sync_row(vs, &vcs->update, ty);
+    }
+}
 
-#define GENERIC
-#define BPP 8
-#include "vnchextile.h"
-#undef BPP
-#undef GENERIC
+/* The dirty tiles from x on in a word of a tile row that go in one
+   rectangle: adjacent dirty tiles, and clean gaps narrower than a
+   rectangle's overhead */
+static inline uint64_t find_update_span(uint64_t row, int x)
+{
+    int i, end = x + 1;
 
-#define GENERIC
-#define BPP 16
-#include "vnchextile.h"
-#undef BPP
-#undef GENERIC
+    for (i = end; i < 64; i++) {
+	if (row & (1ULL << i))
+	    end = i + 1;
+	else if ((i + 1 - end) * VNC_TILE_SIZE > VNC_RECT_OVERHEAD)
+	    break;
+    }
 
-#define GENERIC
-#define BPP 32
-#include "vnchextile.h"
-#undef BPP
-#undef GENERIC
+    if (end - x == 64)
+	return ~(0ULL);
+    return ((1ULL << (end - x)) - 1) << x;
+}
 
-static void send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+/* Extend a span downwards over the tile rows that are dirty in it, as
+   long as the clean tiles in each are narrower than a rectangle's
+   overhead.
+   The bits taken are cleared. */
+static inline int find_update_height(VncState *vs, struct vnc_dirty *d,
+				     int ty, int maxty, int i, uint64_t mask)
 {
-    struct vnc_pm_region_update *rup;
-    int i;
+    uint64_t *row, bits;
+    int h = 1;
 
-    for (i = 0; i < MAX_CLIENTS; i++) {
-	if (!VCS_ACTIVE(vs->vcs[i]))
-	    continue;
+    while (ty + h < maxty) {
+	row = vnc_dirty_row(vs, d, ty + h);
+	bits = row[i] & mask;
+	if (bits == 0 ||
+	    __builtin_popcountll(mask & ~bits) * VNC_TILE_SIZE >
+	    VNC_RECT_OVERHEAD)
+	    break;
+	row[i] &= ~mask;
+	vnc_dirty_sync_row(vs, d, ty + h);
+	h++;
+    }
 
-	rup = malloc(sizeof(struct vnc_pm_region_update));
-	if (rup == NULL)
-	    continue;			/* XXX */
+    return h;
+}
 
-	rup->next = NULL;
-	rup->x = x;
-	rup->y = y;
-	rup->w = w;
-	rup->h = h;
+/* Hand the console's updates to every client, less the tiles the
+   shadow shows did not change. */
+static void vnc_fold_updates(VncState *vs)
+{
+    struct VncClientState *vcs;
+    uint64_t *row, *refresh, rows, bits, changed;
+    int c, i, k, tx, ty, folded = 0;
+
+    for (k = 0; k < vs->row_words; k++) {
+	rows = vs->update.rows[k];
+	vs->update.rows[k] = 0;
+	while (rows) {
+	    ty = k * 64 + __builtin_ctzll(rows);
+	    rows &= rows - 1;
+	    row = vnc_dirty_row(vs, &vs->update, ty);
+	    refresh = vnc_dirty_row(vs, &vs->refresh, ty);
+	    for (i = 0; i < vs->tile_words; i++) {
+		bits = row[i];
+		changed = 0;
+		while (bits) {
+		    tx = __builtin_ctzll(bits);
+		    bits &= bits - 1;
+		    if (vnc_shadow_tile(vs, i * 64 + tx, ty,
+					(refresh[i] >> tx) & 1))
+			changed |= 1ULL << tx;
+		}
+		row[i] = 0;
+		refresh[i] = 0;
+		if (changed == 0)
+		    continue;
+		folded = 1;
+		for (c = 0; c < MAX_CLIENTS; c++) {
+		    vcs = vs->vcs[c];
+		    if (!VCS_ACTIVE(vcs))
+			continue;
+		    vnc_dirty_row(vs, &vcs->update, ty)[i] |= changed;
+		    vcs->update.rows[k] |= 1ULL << (ty % 64);
+		}
+	    }
+	    vnc_dirty_sync_row(vs, &vs->refresh, ty);
+	}
+    }
 
-	*vs->vcs[i]->vpm.vpm_region_updates_last = rup;
-	vs->vcs[i]->vpm.vpm_region_updates_last = &rup->next;
-	dprintf("created rup %d %p %d %d %d %d %d %d\n", vs->vcs[i]->csock,
-		rup, x, y, w, h, vs->vcs[i]->pix_bpp, vs->depth);
+    for (c = 0; folded && vs->damage_time && c < MAX_CLIENTS; c++) {
+	vcs = vs->vcs[c];
+	if (VCS_ACTIVE(vcs) && !vcs->damage_time)
+	    vcs->damage_time = vs->damage_time;
     }
+    vs->damage_time = 0;
 }
 
-static inline int find_update_height(VncState *vs, int y, int maxy,
-				     uint64_t mask)
+/* Whether a client takes an update: it asked for one, or it has
+   continuous updates and not too many of them are in flight */
+static int vnc_update_wanted(struct VncClientState *vcs)
 {
-    int h = 1;
+    if (vcs->continuous_updates)
+	return vcs->frames_in_flight < VNC_MAX_FRAMES_IN_FLIGHT;
+    return vcs->update_requested;
+}
 
-    while (vs->update_row[y + h] & mask) {
-	vs->update_row[y + h] &= ~mask;
-	h++;
-	if (y + h == maxy)
-	    break;
-    }
+/* ready for the rectangles of a new update: it wants one, and is not
+   still waiting to send the last lot */
+static int vnc_update_ready(struct VncClientState *vcs)
+{
+    return VCS_ACTIVE(vcs) && vnc_update_wanted(vcs) &&
+	vcs->vpm.vpm_n_region_updates == 0;
+}
 
-    return h;
+/* Whether a client has updates outstanding in its visible area */
+static int vnc_client_dirty(VncState *vs, struct VncClientState *vcs)
+{
+    if (vcs->vpm.vpm_n_region_updates || vcs->vpm.vpm_n_copy_rects)
+	return 1;
+    return vnc_dirty_test(vs, &vcs->update, vcs->visible_x, vcs->visible_y,
+			  vcs->visible_w, vcs->visible_h);
 }
 
-static void _vnc_update_client(void *opaque)
+/* Arm the update timer for the clients waiting for an update: soon if
+   there is anything for them, else for when the null update is due.
+   Called whenever the console draws, so it is cheap once armed. */
+static void vnc_schedule_update(VncState *vs)
 {
-    VncState *vs = opaque;
-    int64_t now;
-    int y;
-    uint64_t width_mask;
-    int maxx, maxy;
-    int new_rectangles;
+    struct VncClientState *vcs;
+    int64_t due = -1;
+    int i;
 
-    now = vs->ds->get_clock();
+    if (vs->update_scheduled)
+	return;
 
-    if (vs->ds->width != DP2X(vs, DIRTY_PIXEL_BITS))
-	width_mask = (1ULL << X2DP_UP(vs, vs->ds->width)) - 1;
-    else
-	width_mask = ~(0ULL);
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	vcs = vs->vcs[i];
+	if (!VCS_ACTIVE(vcs) || !vnc_update_wanted(vcs))
+	    continue;
+	if (vs->has_update || vnc_client_dirty(vs, vcs)) {
+	    due = MAX((int64_t)vs->ds->get_clock() + VNC_UPDATE_BATCH,
+		      vs->last_update_time + vs->frame_interval);
+	    vs->update_scheduled = 1;
+	    break;
+	}
+	if (!vcs->continuous_updates)
+	    due = vs->last_update_time + VNC_MAX_UPDATE_INTERVAL;
+    }
+    if (due != -1)
+	vs->ds->set_timer(vs->timer, due);
+}
+
+static int vnc_same_updates(VncState *vs, struct VncClientState *a,
+			    struct VncClientState *b)
+{
+    return a->visible_x == b->visible_x && a->visible_y == b->visible_y &&
+	a->visible_w == b->visible_w && a->visible_h == b->visible_h &&
+	memcmp(a->update.tiles, b->update.tiles, vs->tile_rows *
+	       vs->tile_words * sizeof(a->update.tiles[0])) == 0;
+}
 
-    if (!vs->has_update || vs->visible_y >= vs->ds->height 
-	|| vs->visible_x >= vs->ds->width)
-	goto backoff;
+/* Turn the outstanding updates in the visible area of client `leader'
+   into region updates for it and for the clients in `group', which
+   have the same outstanding updates and visible area. */
+static void vnc_update_client_rects(VncState *vs, int leader,
+				    unsigned int group)
+{
+    struct VncClientState *vcs = vs->vcs[leader];
+    struct vnc_dirty *d = &vcs->update;
+    uint64_t *row, rows, visible, bits, mask;
+    int maxx, maxy, tx1, tx2, ty1, ty2;
+    int i, k, x, y, w, h, ty;
 
-    vnc_send_resize(vs->ds);
+    if (vcs->visible_y >= vs->ds->height || vcs->visible_x >= vs->ds->width)
+	return;
 
-    maxy = vs->visible_y + vs->visible_h;
+    maxy = vcs->visible_y + vcs->visible_h;
     if (maxy > vs->ds->height)
 	maxy = vs->ds->height;
-    maxx = vs->visible_x + vs->visible_w;
+    maxx = vcs->visible_x + vcs->visible_w;
     if (maxx > vs->ds->width)
 	maxx = vs->ds->width;
 
-    new_rectangles = 0;
-
-    for (y = vs->visible_y; y < maxy; y++) {
-	int x, h;
-	for (x = X2DP_DOWN(vs, vs->visible_x);
-	     x < X2DP_UP(vs, maxx); x++) {
-	    uint64_t mask = 1ULL << x;
-	    if (vs->update_row[y] & mask) {
-		h = find_update_height(vs, y, maxy, mask);
-		if (h != 0) {
-		    send_framebuffer_update(vs, DP2X(vs, x), y,
-					    DP2X(vs, 1), h);
-		    new_rectangles++;
+    tx1 = X2T_DOWN(vcs->visible_x);
+    tx2 = X2T_UP(maxx);
+    ty1 = X2T_DOWN(vcs->visible_y);
+    ty2 = X2T_UP(maxy);
+    if (tx1 >= tx2 || ty1 >= ty2)
+	return;
+
+    for (k = ty1 / 64; k <= (ty2 - 1) / 64; k++) {
+	rows = d->rows[k] & bits_in_word(k, ty1, ty2);
+	while (rows) {
+	    ty = k * 64 + __builtin_ctzll(rows);
+	    rows &= rows - 1;
+	    row = vnc_dirty_row(vs, d, ty);
+	    for (i = tx1 / 64; i <= (tx2 - 1) / 64; i++) {
+		visible = bits_in_word(i, tx1, tx2);
+		bits = row[i] & visible;
+		row[i] &= ~visible;
+		while (bits) {
+		    x = __builtin_ctzll(bits);
+		    mask = find_update_span(bits, x);
+		    bits &= ~mask;
+		    h = find_update_height(vs, d, ty, ty2, i, mask);
+		    w = T2X(64 - __builtin_clzll(mask) - x);
+		    x = T2X(i * 64 + x);
+		    y = T2X(ty);
+		    send_framebuffer_update(vs, group, x, y,
+					    MIN(w, vs->ds->width - x),
+					    MIN(T2X(h), vs->ds->height - y));
 		}
 	    }
+	    vnc_dirty_sync_row(vs, d, ty);
 	}
-	vs->update_row[y] = 0;
     }
-    if (new_rectangles == 0)
-	goto backoff;
 
-    vnc_write_pending_all(vs);
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	if (i == leader || !(group & (1U << i)))
+	    continue;
+	memcpy(vs->vcs[i]->update.tiles, d->tiles,
+	       vs->tile_rows * vs->tile_words * sizeof(d->tiles[0]));
+	memcpy(vs->vcs[i]->update.rows, d->rows,
+	       vs->row_words * sizeof(d->rows[0]));
+    }
+}
+
+static void _vnc_update_client(void *opaque)
+{
+    VncState *vs = opaque;
+    struct VncClientState *vcs;
+    int64_t now;
+    unsigned int ready, group, waiting;
+    int i, j, updated;
 
-    vs->update_requested = 0;
-    vs->has_update = 0;
-    vs->last_update_time = now;
+    now = vs->ds->get_clock();
+    vs->update_scheduled = 0;
 
-    vs->timer_interval /= 2;
-    if (vs->timer_interval < VNC_REFRESH_INTERVAL_BASE)
-	vs->timer_interval = VNC_REFRESH_INTERVAL_BASE;
+    if (vs->has_update) {
+	vnc_send_resize(vs->ds);
+	vs->generation++;
+	vnc_fold_updates(vs);
+	vs->has_update = 0;
+    }
 
-    return;
+    ready = 0;
+    for (i = 0; i < MAX_CLIENTS; i++)
+	if (vnc_update_ready(vs->vcs[i]))
+	    ready |= 1U << i;
 
- backoff:
-    /* No update -> back off a bit */
-    vs->timer_interval += VNC_REFRESH_INTERVAL_INC;
-    if (vs->timer_interval > VNC_REFRESH_INTERVAL_MAX) {
-	vs->timer_interval = VNC_REFRESH_INTERVAL_MAX;
-	if (now - vs->last_update_time >= VNC_MAX_UPDATE_INTERVAL) {
-	    /* Send a null update.  If the client is no longer
-	       interested (e.g. minimised) it'll ignore this, and we
-	       can stop scanning the buffer until it sends another
-	       update request. */
-	    /* It turns out that there's a bug in realvncviewer 4.1.2
-	       which means that if you send a proper null update (with
-	       no update rectangles), it gets a bit out of sync and
-	       never sends any further requests, regardless of whether
-	       it needs one or not.  Fix this by sending a single 1x1
-	       update rectangle instead. */
-            vnc_send_resize(vs->ds);
-            dprintf("send null update\n");
-	    send_framebuffer_update(vs, 0, 0, 1, 1);
-	    vnc_write_pending_all(vs);
-	    vs->last_update_time = now;
-	    return;
-	}
+    /* clients with the same outstanding updates get the same
+       rectangles, so that they can share their encoding */
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	if (!(ready & (1U << i)))
+	    continue;
+	group = 1U << i;
+	for (j = i + 1; j < MAX_CLIENTS; j++)
+	    if ((ready & (1U << j)) &&
+		vnc_same_updates(vs, vs->vcs[i], vs->vcs[j]))
+		group |= 1U << j;
+	ready &= ~group;
+	vnc_update_client_rects(vs, i, group);
     }
-    vs->update_requested = 1;
-    vs->ds->set_timer(vs->timer, now + vs->timer_interval);
-    return;
+
+    updated = 0;
+    waiting = 0;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+	vcs = vs->vcs[i];
+	if (!VCS_ACTIVE(vcs) || !vnc_update_wanted(vcs))
+	    continue;
+	if (vcs->vpm.vpm_n_region_updates || vcs->vpm.vpm_n_copy_rects) {
+	    vnc_write_pending(vcs);
+	    updated++;
+	} else if (!vcs->continuous_updates)
+	    waiting |= 1U << i;
+    }
+    if (updated) {
+	if (vs->update_allocs + buffer_reallocs == vs->update_allocs_seen)
+	    vs->alloc_free_updates++;
+	else
+	    vs->alloc_free_updates = 0;
+	vs->update_allocs_seen = vs->update_allocs + buffer_reallocs;
+
+	vs->last_update_time = now;
+    } else if (waiting &&
+	       now - vs->last_update_time >= VNC_MAX_UPDATE_INTERVAL) {
+	/* Send a null update.  If the client is no longer
+	   interested (e.g. minimised) it'll ignore this, and we
+	   can stop scanning the buffer until it sends another
+	   update request. */
+	/* It turns out that there's a bug in realvncviewer 4.1.2
+	   which means that if you send a proper null update (with
+	   no update rectangles), it gets a bit out of sync and
+	   never sends any further requests, regardless of whether
+	   it needs one or not.  Fix this by sending a single 1x1
+	   update rectangle instead. */
+	vnc_send_resize(vs->ds);
+	dprintf("send null update\n");
+	send_framebuffer_update(vs, waiting, 0, 0, 1, 1);
+	vnc_write_pending_all(vs);
+	vs->last_update_time = now;
+	return;
+    }
+
+    /* the clients that got nothing are woken by the next drawing */
+    if (waiting)
+	vs->ds->set_timer(vs->timer,
+			  vs->last_update_time + VNC_MAX_UPDATE_INTERVAL);
 }
 
 static void vnc_set_server_text(DisplayState *ds, char *text)
@@ -819,9 +2693,7 @@ static void vnc_update_client(void *opaque)
 static void vnc_timer_init(VncState *vs)
 {
     if (vs->timer == NULL) {
-        vs->update_requested = 1;
 	vs->timer = vs->ds->init_timer(vnc_update_client, vs);
-	vs->timer_interval = VNC_REFRESH_INTERVAL_BASE;
     }
 }
 
@@ -855,7 +2727,15 @@ static int vnc_client_io_error(struct VncClientState *vcs, int ret,
     vcs->csock = -1;
     buffer_reset(&vcs->input);
     buffer_reset(&vcs->output);
-    vnc_reset_pending_messages(&vcs->vpm);
+    vcs->write_armed = 0;
+    vnc_reset_pending_messages(vcs);
+    vnc_zrle_reset(vcs);
+    vnc_tight_reset(vcs);
+    vnc_hextile_cache_release(vcs);
+    vnc_dirty_free(&vcs->update);
+    vcs->update_requested = 0;
+    vcs->damage_time = 0;
+    vcs->sent_damage_time = 0;
     vcs->pix_bpp = 0;
     return 0;
 }
@@ -904,91 +2784,132 @@ static int vnc_process_messages(struct VncClientState *vcs)
 	vnc_send_custom_cursor(vcs);
 	vpm->vpm_cursor_update = 0;
     }
-    if (vpm->vpm_region_updates) {
+    /* one update for each request, or as many as the client lets us
+       have in flight */
+    if (vnc_update_wanted(vcs) &&
+	(vpm->vpm_n_region_updates || vpm->vpm_n_copy_rects)) {
 	uint16_t n_rects;
+	size_t n_rects_offset;
 	struct vnc_pm_region_update *rup;
+	struct vnc_pm_copy_rect *cr;
+	int i, deferred = 0;
 
-	/* Count rectangles */
-	n_rects = 0;
-	for (rup = vpm->vpm_region_updates; rup; rup = rup->next)
-	    n_rects++;
-	dprintf("sending %d rups\n", n_rects);
-
+	/* rectangles are counted as they are written: with LastRect
+	   the count is left open and a terminating rectangle ends the
+	   update, otherwise it is filled in once they are all out */
 	vnc_write_u8(vcs, 0);  /* msg id */
 	vnc_write_u8(vcs, 0);
-	vnc_write_u16(vcs, n_rects);
-	while (vpm->vpm_region_updates) {
-	    int i, j, stride;
-	    uint8_t *row;
-	    rup = vpm->vpm_region_updates;
-	    vpm->vpm_region_updates = rup->next;
-	    vnc_framebuffer_update(vcs, rup->x, rup->y, rup->w, rup->h,
-				   vcs->has_hextile ? 5 : 0);
-	    row = vs->ds->data + rup->y * vs->ds->linesize +
-		rup->x * vs->depth;
-	    stride = vs->ds->linesize;
-        if (vcs->has_hextile) {
-            int has_fg, has_bg;
-            void *last_fg, *last_bg;
-            last_fg = (void *) malloc(vcs->vs->depth);
-            last_bg = (void *) malloc(vcs->vs->depth);
-            has_fg = has_bg = 0;
-            for (j = 0; j < rup->h; j += 16) {
-                for (i = 0; i < rup->w; i += 16) {
-                    vcs->send_hextile_tile(vcs, row + i * vs->depth,
-                               stride,
-                               MIN(16, rup->w - i),
-                               MIN(16, rup->h - j),
-                               last_bg, last_fg,
-                               &has_bg, &has_fg);
-                }
-                row += 16 * stride;
-            }
-            free(last_fg);
-            free(last_bg);
-        } else {
-            for (i = 0; i < rup->h; i++) {
-            vcs->write_pixels(vcs, row, rup->w * vs->depth);
-            row += stride;
-            }
-        }
+	n_rects_offset = vcs->output.offset;
+	vnc_write_u16(vcs, vcs->has_last_rect ? 0xffff : 0);
+	vcs->update_rects = 0;
+	for (i = 0; i < vpm->vpm_n_copy_rects; i++) {
+	    cr = &vpm->vpm_copy_rects[i];
+	    vnc_framebuffer_update(vcs, cr->x, cr->y, cr->w, cr->h,
+				   VNC_ENCODING_COPYRECT);
+	    vnc_write_u16(vcs, cr->src_x);
+	    vnc_write_u16(vcs, cr->src_y);
+	}
+	vpm->vpm_n_copy_rects = 0;
+	for (i = 0; i < vpm->vpm_n_region_updates; i++) {
+	    rup = &vpm->vpm_region_updates[i];
+	    if (vcs->update_rects &&
+		(buffer_length(&vcs->output) >= VNC_MAX_BACKLOG ||
+		 (!vcs->has_last_rect && vcs->update_rects +
+		  vnc_rect_count(vcs, rup->w, rup->h) > 0xffff))) {
+		vnc_dirty_set(vs, &vcs->update, rup->x, rup->y,
+			      rup->w, rup->h);
+		vnc_shared_rect_release(vs, rup->shared);
+		vs->updates_deferred++;
+		deferred++;
+		continue;
+	    }
+	    vnc_update_sent(vcs, rup->x, rup->y, rup->w, rup->h);
+	    send_region_update(vcs, rup);
+	    vnc_shared_rect_release(vs, rup->shared);
 	    dprintf("-- sent rup %p %d %d %d %d\n", rup, rup->x, rup->y,
 		    rup->w, rup->h);
-	    free(rup);
 	}
-	vpm->vpm_region_updates_last = &vpm->vpm_region_updates;
+	vpm->vpm_n_region_updates = 0;
+	dprintf("sent %d rects\n", vcs->update_rects);
+	if (vcs->has_last_rect)
+	    vnc_framebuffer_update(vcs, 0, 0, 0, 0, VNC_ENCODING_LAST_RECT);
+	else {
+	    n_rects = htons(vcs->update_rects);
+	    memcpy(vcs->output.buffer + n_rects_offset, &n_rects, 2);
+	}
+	/* what was deferred is still as old */
+	vcs->sent_damage_time = vcs->damage_time;
+	if (!deferred)
+	    vcs->damage_time = 0;
+	if (!vcs->continuous_updates)
+	    vcs->update_requested = 0;
+	else if (vcs->has_fence) {
+	    uint8_t type = VNC_FENCE_FRAME;
+
+	    vnc_write_fence(vcs, VNC_FENCE_REQUEST | VNC_FENCE_BLOCK_BEFORE,
+			    &type, 1);
+	    vcs->frames_in_flight++;
+	}
     }
-    return vcs->output.offset;
+    return buffer_length(&vcs->output);
+}
+
+static void vnc_latency_add(struct vnc_latency *l, uint64_t us)
+{
+    int i = 63 - __builtin_clzll(us | 1);
+
+    l->buckets[MIN(i, VNC_LATENCY_BUCKETS - 1)]++;
+    l->count++;
+    if (us > l->max)
+	l->max = us;
 }
 
+/* Send what is queued, encoding pending messages as the output
+   empties.  The socket is only polled for writing once it is full. */
 static void vnc_client_write(void *opaque)
 {
     long ret;
+    int last_errno;
     struct VncClientState *vcs = opaque;
     struct VncState *vs = vcs->vs;
 
     while (1) {
-	if (vcs->output.offset == 0 && vnc_process_messages(vcs) == 0) {
-	    dprintf("disable write\n");
-	    vs->ds->set_fd_handler(vcs->csock, NULL, vnc_client_read, NULL,
-				   vcs);
+	if (buffer_empty(&vcs->output) && vnc_process_messages(vcs) == 0) {
+	    if (vcs->write_armed) {
+		dprintf("disable write\n");
+		vs->ds->set_fd_handler(vcs->csock, NULL, vnc_client_read,
+				       NULL, vcs);
+		vcs->write_armed = 0;
+	    }
 	    break;
 	}
 
-	dprintf("write %d\n", vcs->output.offset);
-	ret = send(vcs->csock, vcs->output.buffer, vcs->output.offset, 0);
-	ret = vnc_client_io_error(vcs, ret, socket_error());
+	dprintf("write %d\n", buffer_length(&vcs->output));
+	ret = send(vcs->csock, buffer_start(&vcs->output),
+		   buffer_length(&vcs->output), 0);
+	last_errno = socket_error();
+	if (ret == -1 && (last_errno == EAGAIN || last_errno == EWOULDBLOCK)) {
+	    if (!vcs->write_armed) {
+		dprintf("enable write\n");
+		vs->ds->set_fd_handler(vcs->csock, NULL, vnc_client_read,
+				       vnc_client_write, vcs);
+		vcs->write_armed = 1;
+	    }
+	    break;
+	}
+	ret = vnc_client_io_error(vcs, ret, last_errno);
 	if (!ret) {
-	    dprintf("write error %d with %d\n", errno, vcs->output.offset);
+	    dprintf("write error %d with %d\n", errno,
+		    buffer_length(&vcs->output));
 	    return;
 	}
 
-	memmove(vcs->output.buffer, vcs->output.buffer + ret,
-		vcs->output.offset - ret);
-	vcs->output.offset -= ret;
-
-	if (vcs->output.offset)
-	    break;
+	buffer_advance(&vcs->output, ret);
+	if (buffer_empty(&vcs->output) && vcs->sent_damage_time) {
+	    vnc_latency_add(&vcs->latency,
+			    vs->ds->get_clock() - vcs->sent_damage_time);
+	    vcs->sent_damage_time = 0;
+	}
     }
 }
 
@@ -1033,15 +2954,12 @@ static void vnc_client_read(void *opaque)
     }
 }
 
+/* there are messages for the client: send them now, unless the socket
+   is full and will tell us when it can take more */
 static inline void vnc_write_pending(struct VncClientState *vcs)
 {
-    struct VncState *vs = vcs->vs;
-
-    if (buffer_empty(&vcs->output)) {
-	dprintf("enable write\n");
-	vs->ds->set_fd_handler(vcs->csock, NULL, vnc_client_read,
-			       vnc_client_write, vcs);
-    }
+    if (!vcs->write_armed)
+	vnc_client_write(vcs);
 }
 
 static inline void vnc_write_pending_all(struct VncState *vs)
@@ -1056,9 +2974,6 @@ static inline void vnc_write_pending_all(struct VncState *vs)
 static void vnc_write(struct VncClientState *vcs, const void *data, size_t len)
 {
     buffer_reserve(&vcs->output, len);
-
-    vnc_write_pending(vcs);
-
     buffer_append(&vcs->output, data, len);
 }
 
@@ -1096,8 +3011,8 @@ static void vnc_write_u8(struct VncClientState *vcs, uint8_t value)
 
 static void vnc_flush(struct VncClientState *vcs)
 {
-    if (vcs->output.offset)
-	vnc_client_write(vcs);
+    if (!buffer_empty(&vcs->output))
+	vnc_write_pending(vcs);
 }
 
 static uint8_t read_u8(uint8_t *data, size_t offset)
@@ -1145,7 +3060,7 @@ static void client_cut_text(VncState *vs)
     // KLL otherwise this test will pass on a null pointer...
 
     for(i=0;i<vs->client_cut_text_size;i++)
-	vs->ds->kbd_put_keysym(vs->client_cut_text[i]);
+	vs->ds->kbd_put_keysym(vs->client_cut_text[i], vs->ds->kbd_opaque);
 }
 
 static void check_pointer_type_change(struct VncClientState *vcs, int absolute)
@@ -1308,39 +3223,39 @@ static void do_key_event(VncState *vs, int down, uint32_t sym)
 
             /* When ALT is held down, send an ESC first */
             if (vs->modifiers_state[0x38] || vs->modifiers_state[0xb8])
-                vs->ds->kbd_put_keysym('\033');
+                vs->ds->kbd_put_keysym('\033', vs->ds->kbd_opaque);
             switch (keycode) {
             case 0xc8:
-                vs->ds->kbd_put_keysym(QEMU_KEY_UP + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_UP + mod, vs->ds->kbd_opaque);
                 break;
             case 0xd0:
-                vs->ds->kbd_put_keysym(QEMU_KEY_DOWN + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_DOWN + mod, vs->ds->kbd_opaque);
                 break;
             case 0xcb:
-                vs->ds->kbd_put_keysym(QEMU_KEY_LEFT + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_LEFT + mod, vs->ds->kbd_opaque);
                 break;
             case 0xcd:
-                vs->ds->kbd_put_keysym(QEMU_KEY_RIGHT + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_RIGHT + mod, vs->ds->kbd_opaque);
                 break;
             case 0xd3:
-                vs->ds->kbd_put_keysym(QEMU_KEY_DELETE + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_DELETE + mod, vs->ds->kbd_opaque);
                 break;
             case 0xc7:
-                vs->ds->kbd_put_keysym(QEMU_KEY_HOME + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_HOME + mod, vs->ds->kbd_opaque);
                 break;
             case 0xcf:
-                vs->ds->kbd_put_keysym(QEMU_KEY_END + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_END + mod, vs->ds->kbd_opaque);
                 break;
             case 0xc9:
-                vs->ds->kbd_put_keysym(QEMU_KEY_PAGEUP + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_PAGEUP + mod, vs->ds->kbd_opaque);
                 break;
             case 0xd1:
-                vs->ds->kbd_put_keysym(QEMU_KEY_PAGEDOWN + mod);
+                vs->ds->kbd_put_keysym(QEMU_KEY_PAGEDOWN + mod, vs->ds->kbd_opaque);
                 break;
             default:
 		if (vs->modifiers_state[0x1d] || vs->modifiers_state[0x9d])
 		    sym &= 0x1f;
-                vs->ds->kbd_put_keysym(sym);
+                vs->ds->kbd_put_keysym(sym, vs->ds->kbd_opaque);
                 break;
             }
         }
@@ -1366,12 +3281,13 @@ static void scan_event(VncState *vs, int down, uint32_t code)
 	vs->ds->kbd_put_keycode(code | 0x80);
 }
 
-static void framebuffer_set_updated(VncState *vs, int x, int y, int w, int h)
+/* Unlike updates from the console, these go straight to the one
+   client and are sent whether or not the framebuffer changed: it is
+   asking for it, or has just arrived. */
+static void framebuffer_set_updated(struct VncClientState *vcs,
+				    int x, int y, int w, int h)
 {
-
-    set_bits_in_row(vs, vs->update_row, x, y, w, h);
-
-    vs->has_update = 1;
+    vnc_dirty_set(vcs->vs, &vcs->update, x, y, w, h);
 }
 
 static void framebuffer_update_request(struct VncClientState *vcs,
@@ -1381,36 +3297,97 @@ static void framebuffer_update_request(struct VncClientState *vcs,
 {
     struct VncState *vs = vcs->vs;
     if (!incremental)
-	framebuffer_set_updated(vs, x_position, y_position, w, h);
-    /* XXX */
-    vs->visible_x = 0;
-    vs->visible_y = 0;
-    vs->visible_w = vs->ds->width;
-    vs->visible_h = vs->ds->height;
-    vs->update_requested = 1;
+	framebuffer_set_updated(vcs, x_position, y_position, w, h);
+    vcs->visible_x = x_position;
+    vcs->visible_y = y_position;
+    vcs->visible_w = w;
+    vcs->visible_h = h;
+    vcs->update_requested = 1;
+
+    vnc_schedule_update(vs);
+}
+
+static void client_fence(struct VncClientState *vcs, uint32_t flags,
+			 uint8_t *payload, int len)
+{
+    if (flags & VNC_FENCE_REQUEST) {
+	/* messages are handled one at a time as they arrive, so
+	   blocking before and after comes for free; nothing else is
+	   supported */
+	vnc_write_fence(vcs, flags & (VNC_FENCE_BLOCK_BEFORE |
+				      VNC_FENCE_BLOCK_AFTER), payload, len);
+	vnc_flush(vcs);
+	return;
+    }
+
+    /* the client has drawn a continuous update */
+    if (len == 1 && payload[0] == VNC_FENCE_FRAME && vcs->frames_in_flight) {
+	vcs->frames_in_flight--;
+	vnc_schedule_update(vcs->vs);
+    }
+}
+
+static void enable_continuous_updates(struct VncClientState *vcs,
+				      int enable, int x_position,
+				      int y_position, int w, int h)
+{
+    if (!vcs->has_continuous_updates) {
+	vnc_client_error(vcs);
+	return;
+    }
+
+    if (!enable) {
+	vcs->continuous_updates = 0;
+	vnc_write_u8(vcs, 150);	/* EndOfContinuousUpdates */
+	vnc_flush(vcs);
+	return;
+    }
 
-    vs->ds->set_timer(vs->timer, vs->ds->get_clock());
+    vcs->visible_x = x_position;
+    vcs->visible_y = y_position;
+    vcs->visible_w = w;
+    vcs->visible_h = h;
+    vcs->continuous_updates = 1;
+    vnc_schedule_update(vcs->vs);
 }
 
 static void set_encodings(struct VncClientState *vcs, int32_t *encodings,
 			  size_t n_encodings)
 {
     struct VncState *vs = vcs->vs;
+    int compress_level = TIGHT_DEFAULT_COMPRESSION;
+    int has_fence = 0, has_continuous_updates = 0;
+    int old_encoding = vcs->encoding, old_has_copyrect = vcs->has_copyrect;
+    int old_has_last_rect = vcs->has_last_rect;
     int i;
 
-    vcs->has_hextile = 0;
+    vcs->encoding = VNC_ENCODING_RAW;
     vcs->has_resize = 0;
+    vcs->has_copyrect = 0;
+    vcs->has_last_rect = 0;
     vcs->has_pointer_type_change = 0;
     vcs->has_cursor_encoding = 0;
     vcs->absolute = -1;
 
     for (i = n_encodings - 1; i >= 0; i--) {
 	switch (encodings[i]) {
-	case 0: /* Raw */
-	    vcs->has_hextile = 0;
+	case VNC_ENCODING_RAW:
+	case VNC_ENCODING_RRE:
+	case VNC_ENCODING_CORRE:
+	case VNC_ENCODING_HEXTILE:
+	case VNC_ENCODING_TIGHT:
+	case VNC_ENCODING_ZRLE:
+	    vcs->encoding = encodings[i];
+	    break;
+	case VNC_ENCODING_COPYRECT:
+	    vcs->has_copyrect = 1;
+	    break;
+	case VNC_ENCODING_LAST_RECT:
+	    vcs->has_last_rect = 1;
 	    break;
-	case 5: /* Hextile */
-	    vcs->has_hextile = 1;
+	case VNC_ENCODING_COMPRESSLEVEL0:
+	case VNC_ENCODING_COMPRESSLEVEL0 + 3 ... VNC_ENCODING_COMPRESSLEVEL9:
+	    compress_level = encodings[i] - VNC_ENCODING_COMPRESSLEVEL0;
 	    break;
 	case -223: /* DesktopResize */
 	    vcs->has_resize = 1;
@@ -1419,18 +3396,56 @@ static void set_encodings(struct VncClientState *vcs, int32_t *encodings,
 	    vcs->has_cursor_encoding = 1;
 	    break;
         case -254: /* xencenter */
+	    compress_level = encodings[i] - VNC_ENCODING_COMPRESSLEVEL0;
             break;
         case -255: /* vncviewer client */
             vcs->isvncviewer = 1;
+	    compress_level = encodings[i] - VNC_ENCODING_COMPRESSLEVEL0;
             break;
 	case -257:
 	    vcs->has_pointer_type_change = 1;
 	    break;
+	case VNC_ENCODING_FENCE:
+	    has_fence = 1;
+	    break;
+	case VNC_ENCODING_CONTINUOUS_UPDATES:
+	    has_continuous_updates = 1;
+	    break;
 	default:
 	    break;
 	}
     }
 
+    /* both extensions are confirmed by the server sending one of
+       their messages when the client first asks for them */
+    if (has_fence && !vcs->has_fence) {
+	uint8_t type = VNC_FENCE_INIT;
+
+	vnc_write_fence(vcs, VNC_FENCE_REQUEST, &type, 1);
+    }
+    if (!has_fence)
+	vcs->frames_in_flight = 0;
+    vcs->has_fence = has_fence;
+    if (has_continuous_updates && !vcs->has_continuous_updates)
+	vnc_write_u8(vcs, 150);	/* EndOfContinuousUpdates */
+    if (!has_continuous_updates)
+	vcs->continuous_updates = 0;
+    vcs->has_continuous_updates = has_continuous_updates;
+    vnc_flush(vcs);
+
+    if (vcs->encoding == VNC_ENCODING_ZRLE && vnc_zrle_init(vcs) == -1)
+	vcs->encoding = VNC_ENCODING_RAW;
+    vnc_tight_set_level(vcs, compress_level);
+
+    /* queued updates were encoded, and may be shared, for the old set */
+    if (vcs->encoding != old_encoding ||
+	vcs->has_copyrect != old_has_copyrect ||
+	vcs->has_last_rect != old_has_last_rect) {
+	vnc_flush_region_updates(vcs);
+	framebuffer_set_updated(vcs, 0, 0, vs->ds->width, vs->ds->height);
+	vnc_schedule_update(vs);
+    }
+
     check_pointer_type_change(vcs,
 			      vs->ds->mouse_is_absolute(vs->ds->mouse_opaque));
 }
@@ -1507,11 +3522,19 @@ static void set_pixel_format(struct VncClientState *vcs,
             vcs->blue_shift1 = 0;
             vcs->send_hextile_tile = send_hextile_tile_generic_8;
         }
-        vcs->pix_big_endian = big_endian_flag;
-        vcs->write_pixels = vnc_write_pixels_generic;
+        if (vcs->vs->depth != 1)
+            vcs->write_pixels = vnc_write_pixels_generic;
+        else if (bits_per_pixel == 8)
+            vcs->write_pixels = vnc_write_pixels_table_8;
+        else if (bits_per_pixel == 16)
+            vcs->write_pixels = vnc_write_pixels_table_16;
+        else
+            vcs->write_pixels = vnc_write_pixels_table_32;
         dprintf("set pixel format bpp %d depth %d generic\n", bits_per_pixel,
                 vs->depth);
     }
+    vnc_hextile_cache_release(vcs);
+    vcs->pix_big_endian = big_endian_flag;
     vcs->red_shift = red_shift;
     vcs->red_max = red_max;
     vcs->green_shift = green_shift;
@@ -1519,7 +3542,38 @@ static void set_pixel_format(struct VncClientState *vcs,
     vcs->blue_shift = blue_shift;
     vcs->blue_max = blue_max;
     vcs->pix_bpp = bits_per_pixel / 8;
-    vnc_dpy_resize(vs->ds, vs->ds->width, vs->ds->height);
+    if (vcs->write_pixels != vnc_write_pixels_copy && vs->depth == 1)
+        vnc_build_pix_table(vcs);
+
+    /* ZRLE sends 24-bit colour in 3 bytes when it fits in either the
+       least or the most significant 3 bytes of a 32-bit pixel */
+    vcs->zrle_cpixel_size = vcs->pix_bpp;
+    vcs->zrle_cpixel_offset = 0;
+    if (bits_per_pixel == 32 && depth <= 24) {
+	uint32_t mask = ((uint32_t)red_max << red_shift) |
+	    ((uint32_t)green_max << green_shift) |
+	    ((uint32_t)blue_max << blue_shift);
+
+	if (mask <= 0xffffff) {
+	    vcs->zrle_cpixel_size = 3;
+	    vcs->zrle_cpixel_offset = big_endian_flag ? 1 : 0;
+	} else if ((mask & 0xff) == 0) {
+	    vcs->zrle_cpixel_size = 3;
+	    vcs->zrle_cpixel_offset = big_endian_flag ? 0 : 1;
+	}
+    }
+
+    /* Tight sends 24-bit colour as R, G, B bytes */
+    if (bits_per_pixel == 32 && depth == 24 &&
+	red_max == 0xff && green_max == 0xff && blue_max == 0xff)
+	vcs->tight_tpixel_size = 3;
+    else
+	vcs->tight_tpixel_size = vcs->pix_bpp;
+
+    /* only this client needs repainting in its new format */
+    vnc_flush_region_updates(vcs);
+    framebuffer_set_updated(vcs, 0, 0, vs->ds->width, vs->ds->height);
+    vnc_schedule_update(vs);
 
     dprintf("sending cursor %d for pixel format change\n", vcs->csock);
     vcs->vpm.vpm_cursor_update = 1;
@@ -1589,18 +3643,12 @@ static int protocol_client_msg(struct VncClientState *vcs, uint8_t *data,
 	if (len == 1)
 	    return 8;
 
-        vs->update_requested = 1;
-	vs->timer_interval = VNC_REFRESH_INTERVAL_BASE;
-	vs->ds->set_timer(vs->timer, vs->ds->get_clock() + vs->timer_interval);
 	key_event(vs, read_u8(data, 1), read_u32(data, 4));
 	break;
     case 5:
 	if (len == 1)
 	    return 6;
 
-        vs->update_requested = 1;
-	vs->timer_interval = VNC_REFRESH_INTERVAL_BASE;
-	vs->ds->set_timer(vs->timer, vs->ds->get_clock() + vs->timer_interval);
 	pointer_event(vcs, read_u8(data, 1), read_u16(data, 2),
 		      read_u16(data, 4));
 	break;
@@ -1617,13 +3665,35 @@ static int protocol_client_msg(struct VncClientState *vcs, uint8_t *data,
 
 	client_cut_text_update(vs, read_u32(data, 4), (char *)(data + 8));
 	break;
+    case 150: /* EnableContinuousUpdates */
+	if (len == 1)
+	    return 10;
+
+	enable_continuous_updates(vcs, read_u8(data, 1), read_u16(data, 2),
+				  read_u16(data, 4), read_u16(data, 6),
+				  read_u16(data, 8));
+	break;
+    case 248: /* ClientFence */
+	if (len == 1)
+	    return 9;
+
+	if (len == 9) {
+	    uint8_t v;
+	    v = read_u8(data, 8);
+	    if (v > 64) {
+		vnc_client_error(vcs);
+		break;
+	    }
+	    if (v)
+		return 9 + v;
+	}
+
+	client_fence(vcs, read_u32(data, 4), data + 9, len - 9);
+	break;
     case 254: // Special case, sending keyboard scan codes
 	if (len == 1)
 	    return 8;
 
-	vs->update_requested = 1;
-	vs->timer_interval = VNC_REFRESH_INTERVAL_BASE;
-	vs->ds->set_timer(vs->timer, vs->ds->get_clock() + vs->timer_interval);
 	scan_event(vs, read_u8(data, 1), read_u32(data, 4));
 	break;
     default:
@@ -1702,16 +3772,17 @@ static int protocol_client_init(struct VncClientState *vcs, uint8_t *data,
 static int protocol_response(struct VncClientState *vcs,
 			     uint8_t *client_response, size_t len)
 {
+    VncState *vs = vcs->vs;
     unsigned char cryptchallenge[AUTHCHALLENGESIZE];
     unsigned char key[8];
     int passwdlen, i, j;
 
-    memcpy(cryptchallenge, challenge, AUTHCHALLENGESIZE);
+    memcpy(cryptchallenge, vcs->challenge, AUTHCHALLENGESIZE);
 
     /* Calculate the sent challenge */
-    passwdlen = strlen(vncpasswd);
+    passwdlen = strlen(vs->vncpasswd);
     for (i=0; i<8; i++)
-	key[i] = i<passwdlen ? vncpasswd[i] : 0;
+	key[i] = i<passwdlen ? vs->vncpasswd[i] : 0;
     deskey(key, EN0);
     for (j = 0; j < AUTHCHALLENGESIZE; j += 8)
 	des(cryptchallenge+j, cryptchallenge+j);
@@ -1740,8 +3811,7 @@ static int protocol_response(struct VncClientState *vcs,
 static int protocol_version(struct VncClientState *vcs, uint8_t *version,
 			    size_t len)
 {
-    extern char vncpasswd[64];
-    extern unsigned char challenge[AUTHCHALLENGESIZE];
+    VncState *vs = vcs->vs;
     char local[13];
     int  support, maj, min;
 
@@ -1770,7 +3840,7 @@ static int protocol_version(struct VncClientState *vcs, uint8_t *version,
     }
 
     dprintf("authentication\n");
-    if (*vncpasswd == '\0') {
+    if (*vs->vncpasswd == '\0') {
 	/* AuthType is None */
 	vnc_write_u32(vcs, 1);
 	vnc_flush(vcs);
@@ -1781,8 +3851,8 @@ static int protocol_version(struct VncClientState *vcs, uint8_t *version,
 
 	/* Challenge-Responce authentication */
 	/* Send Challenge */
-	make_challenge(challenge, AUTHCHALLENGESIZE);
-	vnc_write(vcs, challenge, AUTHCHALLENGESIZE);
+	make_challenge(vcs->challenge, AUTHCHALLENGESIZE);
+	vnc_write(vcs, vcs->challenge, AUTHCHALLENGESIZE);
 	vnc_flush(vcs);
 	vnc_read_when(vcs, protocol_response, AUTHCHALLENGESIZE);
     }
@@ -1798,6 +3868,9 @@ static void vnc_listen_read(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int new_sock;
     int i;
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat;
+#endif
 
     new_sock = accept(vs->lsock, (struct sockaddr *)&addr, &addrlen);
     if (new_sock == -1)
@@ -1817,11 +3890,18 @@ static void vnc_listen_read(void *opaque)
     }
 
     vcs = vs->vcs[i];
+    if (vnc_dirty_alloc(vs, &vcs->update) == -1)
+	goto fail;
     vcs->vs = vs;
-    vcs->vpm.vpm_region_updates_last = &vcs->vpm.vpm_region_updates;
     vcs->csock = new_sock;
     vcs->isvncviewer = 0;
     socket_set_nonblock(vcs->csock);
+    socket_set_cloexec(vcs->csock);
+#ifdef TCP_NOTSENT_LOWAT
+    lowat = VNC_NOTSENT_LOWAT;
+    setsockopt(vcs->csock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+	       &lowat, sizeof(lowat));	/* fails harmlessly on AF_UNIX */
+#endif
     vs->ds->set_fd_handler(vcs->csock, NULL, vnc_client_read, NULL, vcs);
     vs->ds->set_fd_error_handler(vcs->csock, vnc_client_error);
     dprintf("rfb greeting\n");
@@ -1829,7 +3909,10 @@ static void vnc_listen_read(void *opaque)
     vnc_flush(vcs);
     vnc_read_when(vcs, protocol_version, 12);
     vcs->has_resize = 0;
-    vcs->has_hextile = 0;
+    vcs->has_copyrect = 0;
+    vcs->has_last_rect = 0;
+    vcs->encoding = VNC_ENCODING_RAW;
+    vcs->tight_level = TIGHT_DEFAULT_COMPRESSION;
     vcs->last_x = -1;
     vcs->last_y = -1;
     if (vs->depth == 1) {
@@ -1845,7 +3928,17 @@ static void vnc_listen_read(void *opaque)
         vcs->green_max1 = 255;
         vcs->blue_max1 = 255;
     }
-    framebuffer_set_updated(vs, 0, 0, vs->ds->width, vs->ds->height);
+    vcs->update_requested = 0;
+    vcs->continuous_updates = 0;
+    vcs->frames_in_flight = 0;
+    vcs->has_fence = 0;
+    vcs->has_continuous_updates = 0;
+    vcs->visible_x = 0;
+    vcs->visible_y = 0;
+    vcs->visible_w = vs->ds->width;
+    vcs->visible_h = vs->ds->height;
+    memset(&vcs->latency, 0, sizeof(vcs->latency));
+    framebuffer_set_updated(vcs, 0, 0, vs->ds->width, vs->ds->height);
     vnc_timer_init(vs);		/* XXX */
     return;
 
@@ -1891,6 +3984,8 @@ int vnc_display_init(DisplayState *ds, struct sockaddr *addr,
     vs->lsock = -1;
     ds->depth = 8;
     vs->depth = 1;
+    vs->frame_interval = 1000000 / VNC_DEFAULT_MAX_FPS;
+    hextile_simd_init();
 
     vs->ds = ds;
 
@@ -1914,6 +4009,7 @@ int vnc_display_init(DisplayState *ds, struct sockaddr *addr,
     vs->ds->dpy_set_server_text = vnc_set_server_text;
     vs->ds->dpy_bell = vnc_send_bell;
     vs->ds->dpy_copy_rect = vnc_dpy_copy_rect;
+    vs->ds->dpy_dump_stats = vnc_dpy_dump_stats;
     vs->ds->dpy_clients_connected = vnc_dpy_clients_connected;
     vs->ds->dpy_close_vncviewer_connections = vnc_dpy_close_vncviewer_connections;
 
@@ -1982,6 +4078,13 @@ int vnc_display_init(DisplayState *ds, struct sockaddr *addr,
 	return 0;
 }
 
+void vnc_set_max_fps(DisplayState *ds, int max_fps)
+{
+    VncState *vs = ds->opaque;
+
+    vs->frame_interval = max_fps > 0 ? 1000000 / max_fps : 0;
+}
+
 unsigned int seed;
 
 static int make_challenge(unsigned char *random, int size)
@@ -33,6 +33,3 @@ typedef struct QEMUTimer QEMUTimer;
 #define	vnc_mallocz(s) qemu_mallocz(s)
 #define	vnc_free(p) qemu_free((p))
 #endif
-
-extern char vncpasswd[64];
-extern unsigned char challenge[AUTHCHALLENGESIZE];
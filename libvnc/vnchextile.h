@@ -7,27 +7,19 @@
 #define NAME BPP
 #endif
 
-static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
-                                             uint8_t *data, int stride,
-                                             int w, int h,
-                                             void *last_bg_, 
-                                             void *last_fg_,
-                                             int *has_bg, int *has_fg)
+/* Returns the number of colours in the tile, 3 meaning three or more,
+   and its background and foreground. */
+static int CONCAT(hextile_analyse_tile_, NAME)(uint8_t *data, int stride,
+                                               int w, int h,
+                                               pixel_t *bg_, pixel_t *fg_)
 {
-    struct VncState *vs = vcs->vs;
     pixel_t *irow = (pixel_t *)data;
     int j, i;
-    pixel_t *last_bg = (pixel_t *)last_bg_;
-    pixel_t *last_fg = (pixel_t *)last_fg_;
     pixel_t bg = 0;
     pixel_t fg = 0;
     int n_colors = 0;
     int bg_count = 0;
     int fg_count = 0;
-    int flags = 0;
-    uint8_t pdata[(vcs->pix_bpp + 2) * 16 * 16];
-    int n_pdata = 0;
-    int n_subtiles = 0;
 
     for (j = 0; j < h; j++) {
 	for (i = 0; i < w; i++) {
@@ -67,6 +59,47 @@ static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
 	bg = tmp;
     }
 
+    *bg_ = bg;
+    *fg_ = fg;
+    return n_colors;
+}
+
+#ifdef GENERIC
+#define PUT_PIXEL(p, v) (vnc_pixel_to_client(vcs, (p), (v)), vcs->pix_bpp)
+#else
+#define PUT_PIXEL(p, v) (memcpy((p), &(v), sizeof(pixel_t)), sizeof(pixel_t))
+#endif
+
+/* Writes the tile straight into the output buffer, which the caller
+   has reserved HEXTILE_MAX_TILE_SIZE bytes of. */
+static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
+                                             uint8_t *data, int stride,
+                                             int w, int h,
+                                             void *last_bg_, 
+                                             void *last_fg_,
+                                             int *has_bg, int *has_fg)
+{
+    struct VncState *vs = vcs->vs;
+    pixel_t *irow;
+    int j, i;
+    pixel_t *last_bg = (pixel_t *)last_bg_;
+    pixel_t *last_fg = (pixel_t *)last_fg_;
+    pixel_t bg = 0;
+    pixel_t fg = 0;
+    int n_colors;
+    int flags = 0;
+    uint8_t *tile, *p, *subrects;
+    int n_subtiles = 0;
+#if BPP == 8
+    uint16_t fg_masks[16];
+
+    if (w == 16)
+	n_colors = hextile_analyse_16x8(data, stride, h, &bg, &fg, fg_masks);
+    else
+#endif
+	n_colors = CONCAT(hextile_analyse_tile_, NAME)(data, stride, w, h,
+						       &bg, &fg);
+
     if (!*has_bg || *last_bg != bg) {
 	flags |= 0x02;
 	*has_bg = 1;
@@ -79,13 +112,32 @@ static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
 	*last_fg = fg;
     }
 
+    if (n_colors == 2)
+	flags |= 0x08;
+    else if (n_colors == 3)
+	flags |= 0x18;
+
+    tile = p = buffer_end(&vcs->output);
+    *p++ = flags;
+    if (flags & 0x02)
+	p += PUT_PIXEL(p, bg);
+    if (flags & 0x04)
+	p += PUT_PIXEL(p, fg);
+    /* the subrect count goes first, and is filled in below */
+    subrects = p + 1;
+
     switch (n_colors) {
     case 1:
-	n_pdata = 0;
 	break;
     case 2:
-	flags |= 0x08;
-
+	p = subrects;
+#if BPP == 8
+	if (w == 16) {
+	    n_subtiles = hextile_fg_runs_16(fg_masks, h, p);
+	    p += 2 * n_subtiles;
+	    break;
+	}
+#endif
 	irow = (pixel_t *)data;
 	
 	for (j = 0; j < h; j++) {
@@ -95,28 +147,24 @@ static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
 		    if (min_x == -1)
 			min_x = i;
 		} else if (min_x != -1) {
-		    hextile_enc_cord(pdata + n_pdata, min_x, j, i - min_x, 1);
-		    n_pdata += 2;
+		    hextile_enc_cord(p, min_x, j, i - min_x, 1);
+		    p += 2;
 		    n_subtiles++;
 		    min_x = -1;
 		}
 	    }
 	    if (min_x != -1) {
-		hextile_enc_cord(pdata + n_pdata, min_x, j, i - min_x, 1);
-		n_pdata += 2;
+		hextile_enc_cord(p, min_x, j, i - min_x, 1);
+		p += 2;
 		n_subtiles++;
 	    }
 	    irow += stride / sizeof(pixel_t);
 	}
 	break;
     case 3:
-	flags |= 0x18;
-
+	p = subrects;
 	irow = (pixel_t *)data;
 
-	if (!*has_bg || *last_bg != bg)
-	    flags |= 0x02;
-
 	for (j = 0; j < h; j++) {
 	    int has_color = 0;
 	    int min_x = -1;
@@ -131,15 +179,9 @@ static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
 		    has_color = 1;
 		} else if (irow[i] != color) {
 		    has_color = 0;
-#ifdef GENERIC
-            vnc_convert_pixel(vcs, pdata + n_pdata, color);
-            n_pdata += vcs->pix_bpp;
-#else
-	        memcpy(pdata + n_pdata, &color, sizeof(color));
-            n_pdata += sizeof(pixel_t);
-#endif
-		    hextile_enc_cord(pdata + n_pdata, min_x, j, i - min_x, 1);
-		    n_pdata += 2;
+		    p += PUT_PIXEL(p, color);
+		    hextile_enc_cord(p, min_x, j, i - min_x, 1);
+		    p += 2;
 		    n_subtiles++;
 
 		    min_x = -1;
@@ -151,15 +193,9 @@ static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
 		}
 	    }
 	    if (has_color) {
-#ifdef GENERIC
-        vnc_convert_pixel(vcs, pdata + n_pdata, color);
-        n_pdata += vcs->pix_bpp;
-#else
-        memcpy(pdata + n_pdata, &color, sizeof(color));
-        n_pdata += sizeof(pixel_t);
-#endif
-		hextile_enc_cord(pdata + n_pdata, min_x, j, i - min_x, 1);
-		n_pdata += 2;
+		p += PUT_PIXEL(p, color);
+		hextile_enc_cord(p, min_x, j, i - min_x, 1);
+		p += 2;
 		n_subtiles++;
 	    }
 	    irow += stride / sizeof(pixel_t);
@@ -167,10 +203,8 @@ static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
 
 	/* A SubrectsColoured subtile invalidates the foreground color */
 	*has_fg = 0;
-	if (n_pdata > (w * h * sizeof(pixel_t))) {
+	if (p - subrects > (w * h * sizeof(pixel_t))) {
 	    n_colors = 4;
-	    flags = 0x01;
-	    *has_bg = 0;
 
 	    /* we really don't have to invalidate either the bg or fg
 	       but we've lost the old values.  oh well. */
@@ -180,30 +214,31 @@ static void CONCAT(send_hextile_tile_, NAME)(struct VncClientState *vcs,
     }
 
     if (n_colors > 3) {
-	flags = 0x01;
 	*has_fg = 0;
 	*has_bg = 0;
-	n_colors = 4;
-    }
-
-    vnc_write_u8(vcs, flags);
-    if (n_colors < 4) {
-	if (flags & 0x02)
-	    vcs->write_pixels(vcs, last_bg, sizeof(pixel_t));
-	if (flags & 0x04)
-	    vcs->write_pixels(vcs, last_fg, sizeof(pixel_t));
-	if (n_subtiles) {
-	    vnc_write_u8(vcs, n_subtiles);
-	    vnc_write(vcs, pdata, n_pdata);
-	}
-    } else {
+	p = tile;
+	*p++ = 0x01;
+#ifdef GENERIC
+	vcs->output.offset = p - vcs->output.buffer;
 	for (j = 0; j < h; j++) {
 	    vcs->write_pixels(vcs, data, w * vs->depth);
 	    data += stride;
 	}
-    }
+	return;
+#else
+	for (j = 0; j < h; j++) {
+	    memcpy(p, data, w * vs->depth);
+	    p += w * vs->depth;
+	    data += stride;
+	}
+#endif
+    } else if (n_subtiles)
+	subrects[-1] = n_subtiles;
+
+    vcs->output.offset = p - vcs->output.buffer;
 }
 
+#undef PUT_PIXEL
 #undef NAME
 #undef pixel_t
 #undef CONCAT_I
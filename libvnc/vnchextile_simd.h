@@ -0,0 +1,131 @@
+/* Hextile tile analysis for 16 pixel wide tiles of an 8bpp framebuffer.
+   A tile row is 16 bytes: it is compared against a colour in one go,
+   giving a 16 bit mask of the matching pixels, and colour counting and
+   fg run extraction then work on the row masks. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define HEXTILE_SIMD_X86
+#endif
+
+typedef void HextileRowMasks(uint8_t *data, int stride, int h, uint8_t v,
+                             uint16_t *masks);
+
+static void hextile_row_masks_c(uint8_t *data, int stride, int h, uint8_t v,
+                                uint16_t *masks)
+{
+    int i, j;
+
+    for (j = 0; j < h; j++) {
+        masks[j] = 0;
+        for (i = 0; i < 16; i++)
+            if (data[i] == v)
+                masks[j] |= 1 << i;
+        data += stride;
+    }
+}
+
+#ifdef HEXTILE_SIMD_X86
+__attribute__((target("sse2")))
+static void hextile_row_masks_sse2(uint8_t *data, int stride, int h,
+                                   uint8_t v, uint16_t *masks)
+{
+    __m128i c = _mm_set1_epi8(v);
+    int j;
+
+    for (j = 0; j < h; j++) {
+        __m128i row = _mm_loadu_si128((__m128i *)data);
+
+        masks[j] = _mm_movemask_epi8(_mm_cmpeq_epi8(row, c));
+        data += stride;
+    }
+}
+#endif
+
+static HextileRowMasks *hextile_row_masks = hextile_row_masks_c;
+
+static void hextile_simd_init(void)
+{
+#ifdef HEXTILE_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        hextile_row_masks = hextile_row_masks_sse2;
+        dprintf("hextile: using sse2\n");
+    }
+#endif
+}
+
+/* Find the background and foreground of a tile exactly as the scalar
+   scan in vnchextile.h does: bg is the first pixel and fg the first
+   one that differs, and they are swapped if fg is the more common of
+   the two among the pixels after fg and before any third colour.
+   Returns the number of colours, 3 meaning three or more; fg_masks
+   then has the pixels matching the final fg. */
+static int hextile_analyse_16x8(uint8_t *data, int stride, int h,
+                                uint8_t *bg, uint8_t *fg,
+                                uint16_t *fg_masks)
+{
+    uint16_t bg_masks[16];
+    unsigned int sel, other;
+    int j, k, m, bg_count = 0, fg_count = 0;
+
+    *bg = data[0];
+    hextile_row_masks(data, stride, h, *bg, bg_masks);
+    for (j = 0; j < h && bg_masks[j] == 0xffff; j++)
+        ;
+    if (j == h)
+        return 1;
+
+    k = j * 16 + __builtin_ctz(~bg_masks[j] & 0xffff);
+    *fg = data[j * stride + k % 16];
+    hextile_row_masks(data, stride, h, *fg, fg_masks);
+
+    m = h * 16;
+    for (; j < h; j++) {
+        other = ~(bg_masks[j] | fg_masks[j]) & 0xffff;
+        if (other) {
+            m = j * 16 + __builtin_ctz(other);
+            break;
+        }
+    }
+
+    /* counts cover the pixels strictly between k and m */
+    for (j = k / 16; j < h && j <= m / 16; j++) {
+        sel = 0xffff;
+        if (j == k / 16)
+            sel &= ~((2u << (k % 16)) - 1);
+        if (j == m / 16)
+            sel &= (1u << (m % 16)) - 1;
+        bg_count += __builtin_popcount(bg_masks[j] & sel);
+        fg_count += __builtin_popcount(fg_masks[j] & sel);
+    }
+
+    if (fg_count > bg_count) {
+        uint8_t tmp = *fg;
+
+        *fg = *bg;
+        *bg = tmp;
+        memcpy(fg_masks, bg_masks, h * sizeof(bg_masks[0]));
+    }
+
+    return m < h * 16 ? 3 : 2;
+}
+
+/* the subrects of a two colour tile: one per run of fg in each row */
+static int hextile_fg_runs_16(uint16_t *fg_masks, int h, uint8_t *pdata)
+{
+    unsigned int mask;
+    int j, x, len, n = 0;
+
+    for (j = 0; j < h; j++) {
+        mask = fg_masks[j];
+        while (mask) {
+            x = __builtin_ctz(mask);
+            len = __builtin_ctz(~(mask >> x));
+            hextile_enc_cord(pdata + 2 * n, x, j, len, 1);
+            n++;
+            mask &= ~(((1u << len) - 1) << x);
+        }
+    }
+    return n;
+}
@@ -0,0 +1,86 @@
+#define CONCAT_I(a, b) a ## b
+#define CONCAT(a, b) CONCAT_I(a, b)
+#define pixel_t CONCAT(uint, CONCAT(BPP, _t))
+#define NAME BPP
+
+/* Encode a rectangle as RRE, or CoRRE if compact: the most common
+   colour as background and a subrect for each run of another colour
+   in a row.  Returns -1 as soon as that gets larger than the raw
+   pixels, leaving what has been written so far in the output. */
+static int CONCAT(send_rre_, NAME)(struct VncClientState *vcs,
+                                   uint8_t *data, int stride,
+                                   int w, int h, int compact)
+{
+    pixel_t *irow = (pixel_t *)data;
+    pixel_t bg, color;
+    uint8_t buf[4 + 8];
+    int n_subrects = 0, max_subrects;
+    size_t count_offset;
+    uint32_t count;
+    int i, j, x, n;
+#if BPP == 8
+    int counts[256];
+
+    memset(counts, 0, sizeof(counts));
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++)
+            counts[irow[i]]++;
+        irow += stride / sizeof(pixel_t);
+    }
+    bg = 0;
+    for (i = 1; i < 256; i++)
+        if (counts[i] > counts[bg])
+            bg = i;
+    irow = (pixel_t *)data;
+#else
+    bg = irow[0];
+#endif
+
+    max_subrects = w * h * vcs->pix_bpp / (vcs->pix_bpp + (compact ? 4 : 8));
+
+    count_offset = vcs->output.offset;
+    vnc_write_u32(vcs, 0);
+    vnc_pixel_to_client(vcs, buf, bg);
+    vnc_write(vcs, buf, vcs->pix_bpp);
+
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i = x) {
+            color = irow[i];
+            for (x = i + 1; x < w && irow[x] == color; x++)
+                ;
+            if (color == bg)
+                continue;
+
+            if (++n_subrects > max_subrects)
+                return -1;
+            vnc_pixel_to_client(vcs, buf, color);
+            n = vcs->pix_bpp;
+            if (compact) {
+                buf[n++] = i;
+                buf[n++] = j;
+                buf[n++] = x - i;
+                buf[n++] = 1;
+            } else {
+                buf[n++] = i >> 8;
+                buf[n++] = i;
+                buf[n++] = j >> 8;
+                buf[n++] = j;
+                buf[n++] = (x - i) >> 8;
+                buf[n++] = x - i;
+                buf[n++] = 0;
+                buf[n++] = 1;
+            }
+            vnc_write(vcs, buf, n);
+        }
+        irow += stride / sizeof(pixel_t);
+    }
+
+    count = htonl(n_subrects);
+    memcpy(vcs->output.buffer + count_offset, &count, 4);
+    return n_subrects;
+}
+
+#undef NAME
+#undef pixel_t
+#undef CONCAT_I
+#undef CONCAT
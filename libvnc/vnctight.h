@@ -0,0 +1,104 @@
+#define CONCAT_I(a, b) a ## b
+#define CONCAT(a, b) CONCAT_I(a, b)
+#define pixel_t CONCAT(uint, CONCAT(BPP, _t))
+#define NAME BPP
+
+/* Collect the distinct colours of a rectangle into vcs->tight_palette.
+   Returns the number of colours, or 0 if there are more than
+   max_colors. */
+static int CONCAT(tight_fill_palette_, NAME)(struct VncClientState *vcs,
+                                             uint8_t *data, int stride,
+                                             int w, int h, int max_colors)
+{
+    pixel_t *irow = (pixel_t *)data;
+    pixel_t prev = 0;
+    int has_prev = 0;
+    int i, j;
+
+    tight_palette_reset(vcs);
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++) {
+            if (has_prev && irow[i] == prev)
+                continue;
+            prev = irow[i];
+            has_prev = 1;
+            if (tight_palette_insert(vcs, prev, max_colors) == -1)
+                return 0;
+        }
+        irow += stride / sizeof(pixel_t);
+    }
+
+    return vcs->tight_palette.n_colors;
+}
+
+/* Palette filter output: one bit per pixel, rows padded to a byte, for
+   two colours; one byte per pixel otherwise. */
+static void CONCAT(tight_encode_indexed_, NAME)(struct VncClientState *vcs,
+                                                uint8_t *data, int stride,
+                                                int w, int h)
+{
+    pixel_t *irow = (pixel_t *)data;
+    pixel_t prev = 0;
+    int idx = -1;
+    int i, j;
+
+    if (vcs->tight_palette.n_colors == 2) {
+        uint32_t c1 = vcs->tight_palette.colors[1];
+
+        buffer_reserve(&vcs->tight, h * ((w + 7) / 8));
+        for (j = 0; j < h; j++) {
+            uint8_t byte = 0;
+            int nbits = 0;
+
+            for (i = 0; i < w; i++) {
+                byte = (byte << 1) | (irow[i] == c1);
+                if (++nbits == 8) {
+                    buffer_append(&vcs->tight, &byte, 1);
+                    byte = 0;
+                    nbits = 0;
+                }
+            }
+            if (nbits) {
+                byte <<= 8 - nbits;
+                buffer_append(&vcs->tight, &byte, 1);
+            }
+            irow += stride / sizeof(pixel_t);
+        }
+        return;
+    }
+
+    buffer_reserve(&vcs->tight, w * h);
+    for (j = 0; j < h; j++) {
+        uint8_t *out = buffer_end(&vcs->tight);
+
+        for (i = 0; i < w; i++) {
+            if (idx == -1 || irow[i] != prev) {
+                prev = irow[i];
+                idx = tight_palette_lookup(vcs, prev);
+            }
+            out[i] = idx;
+        }
+        vcs->tight.offset += w;
+        irow += stride / sizeof(pixel_t);
+    }
+}
+
+/* Copy filter output: every pixel as a TPIXEL */
+static void CONCAT(tight_encode_full_, NAME)(struct VncClientState *vcs,
+                                             uint8_t *data, int stride,
+                                             int w, int h)
+{
+    pixel_t *irow = (pixel_t *)data;
+    int i, j;
+
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++)
+            tight_put_tpixel(vcs, &vcs->tight, irow[i]);
+        irow += stride / sizeof(pixel_t);
+    }
+}
+
+#undef NAME
+#undef pixel_t
+#undef CONCAT_I
+#undef CONCAT
@@ -0,0 +1,25 @@
+#define CONCAT_I(a, b) a ## b
+#define CONCAT(a, b) CONCAT_I(a, b)
+#define NAME BPP
+
+/* Translate 8bpp framebuffer pixels to BPP client pixels through the
+   client's lookup table, straight into the output buffer. */
+static void CONCAT(vnc_write_pixels_table_, NAME)(struct VncClientState *vcs,
+                                                  void *pixels, int size)
+{
+    uint8_t *src = pixels;
+    uint8_t *dst;
+    int i;
+
+    buffer_reserve(&vcs->output, size * (BPP / 8));
+    dst = buffer_end(&vcs->output);
+    for (i = 0; i < size; i++) {
+        memcpy(dst, vcs->pix_table[src[i]], BPP / 8);
+        dst += BPP / 8;
+    }
+    vcs->output.offset += size * (BPP / 8);
+}
+
+#undef NAME
+#undef CONCAT_I
+#undef CONCAT
@@ -0,0 +1,182 @@
+#define CONCAT_I(a, b) a ## b
+#define CONCAT(a, b) CONCAT_I(a, b)
+#define pixel_t CONCAT(uint, CONCAT(BPP, _t))
+#define NAME BPP
+
+static int CONCAT(zrle_palette_index_, NAME)(pixel_t *palette, int n_palette,
+                                             pixel_t p)
+{
+    int i;
+
+    for (i = 0; i < n_palette; i++)
+        if (palette[i] == p)
+            return i;
+    return -1;
+}
+
+/* Encode one ZRLE tile into vcs->zrle.  The tile is scanned once to
+   collect its palette and runs, which is enough to size every
+   subencoding; the cheapest one is then emitted. */
+static void CONCAT(send_zrle_tile_, NAME)(struct VncClientState *vcs,
+                                          uint8_t *data, int stride,
+                                          int w, int h)
+{
+    pixel_t palette[ZRLE_MAX_PALETTE];
+    pixel_t *irow;
+    pixel_t prev = 0;
+    int n_palette = 0, palette_full = 0;
+    int runs = 0, single_runs = 0, run_bytes = 0, run_len = 0;
+    int cpb = vcs->zrle_cpixel_size;
+    int raw_size, plain_rle_size, palette_rle_size, packed_size;
+    int bits = 0;
+    int i, j, idx;
+
+    irow = (pixel_t *)data;
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++) {
+            if (run_len && irow[i] == prev) {
+                run_len++;
+                continue;
+            }
+            if (run_len) {
+                runs++;
+                if (run_len == 1)
+                    single_runs++;
+                run_bytes += (run_len - 1) / 255 + 1;
+            }
+            prev = irow[i];
+            run_len = 1;
+            if (!palette_full &&
+                CONCAT(zrle_palette_index_, NAME)(palette, n_palette,
+                                                  prev) == -1) {
+                if (n_palette == ZRLE_MAX_PALETTE)
+                    palette_full = 1;
+                else
+                    palette[n_palette++] = prev;
+            }
+        }
+        irow += stride / sizeof(pixel_t);
+    }
+    runs++;
+    if (run_len == 1)
+        single_runs++;
+    run_bytes += (run_len - 1) / 255 + 1;
+
+    if (!palette_full && n_palette == 1) {
+        zrle_put_u8(vcs, 1);
+        zrle_put_cpixel(vcs, palette[0]);
+        return;
+    }
+
+    raw_size = w * h * cpb;
+    plain_rle_size = runs * cpb + run_bytes;
+    palette_rle_size = packed_size = INT_MAX;
+    if (!palette_full) {
+        /* single pixel runs need no length in palette RLE */
+        palette_rle_size = n_palette * cpb + runs + run_bytes - single_runs;
+        if (n_palette <= 16) {
+            bits = n_palette == 2 ? 1 : n_palette <= 4 ? 2 : 4;
+            packed_size = n_palette * cpb + h * ((w * bits + 7) / 8);
+        }
+    }
+
+    if (packed_size <= palette_rle_size && packed_size <= plain_rle_size &&
+        packed_size < raw_size) {
+        zrle_put_u8(vcs, n_palette);
+        for (i = 0; i < n_palette; i++)
+            zrle_put_cpixel(vcs, palette[i]);
+
+        irow = (pixel_t *)data;
+        for (j = 0; j < h; j++) {
+            uint8_t byte = 0;
+            int nbits = 0;
+
+            for (i = 0; i < w; i++) {
+                idx = CONCAT(zrle_palette_index_, NAME)(palette, n_palette,
+                                                        irow[i]);
+                byte = (byte << bits) | idx;
+                nbits += bits;
+                if (nbits == 8) {
+                    zrle_put_u8(vcs, byte);
+                    byte = 0;
+                    nbits = 0;
+                }
+            }
+            if (nbits)
+                zrle_put_u8(vcs, byte << (8 - nbits));
+            irow += stride / sizeof(pixel_t);
+        }
+    } else if (palette_rle_size <= plain_rle_size &&
+               palette_rle_size < raw_size) {
+        zrle_put_u8(vcs, 128 + n_palette);
+        for (i = 0; i < n_palette; i++)
+            zrle_put_cpixel(vcs, palette[i]);
+
+        run_len = 0;
+        irow = (pixel_t *)data;
+        for (j = 0; j < h; j++) {
+            for (i = 0; i < w; i++) {
+                if (run_len && irow[i] == prev) {
+                    run_len++;
+                    continue;
+                }
+                if (run_len) {
+                    idx = CONCAT(zrle_palette_index_, NAME)(palette, n_palette,
+                                                            prev);
+                    if (run_len == 1) {
+                        zrle_put_u8(vcs, idx);
+                    } else {
+                        zrle_put_u8(vcs, idx | 128);
+                        zrle_put_run_length(vcs, run_len);
+                    }
+                }
+                prev = irow[i];
+                run_len = 1;
+            }
+            irow += stride / sizeof(pixel_t);
+        }
+        idx = CONCAT(zrle_palette_index_, NAME)(palette, n_palette, prev);
+        if (run_len == 1) {
+            zrle_put_u8(vcs, idx);
+        } else {
+            zrle_put_u8(vcs, idx | 128);
+            zrle_put_run_length(vcs, run_len);
+        }
+    } else if (plain_rle_size < raw_size) {
+        zrle_put_u8(vcs, 128);
+
+        run_len = 0;
+        irow = (pixel_t *)data;
+        for (j = 0; j < h; j++) {
+            for (i = 0; i < w; i++) {
+                if (run_len && irow[i] == prev) {
+                    run_len++;
+                    continue;
+                }
+                if (run_len) {
+                    zrle_put_cpixel(vcs, prev);
+                    zrle_put_run_length(vcs, run_len);
+                }
+                prev = irow[i];
+                run_len = 1;
+            }
+            irow += stride / sizeof(pixel_t);
+        }
+        zrle_put_cpixel(vcs, prev);
+        zrle_put_run_length(vcs, run_len);
+    } else {
+        zrle_put_u8(vcs, 0);
+
+        irow = (pixel_t *)data;
+        for (j = 0; j < h; j++) {
+            for (i = 0; i < w; i++)
+                zrle_put_cpixel(vcs, irow[i]);
+            irow += stride / sizeof(pixel_t);
+        }
+    }
+}
+
+#undef NAME
+#undef pixel_t
+#undef CONCAT_I
+#undef CONCAT
@@ -26,6 +26,7 @@
 #include <sys/prctl.h>
 
 #include <locale.h>
+#include <wordexp.h>
 
 #ifndef NXENSTORE
 #include <xs.h>
@@ -39,6 +40,19 @@
 #include <sys/select.h>
 #endif
 
+/* epoll keeps the interest set in the kernel, so that it is changed
+   per fd rather than rebuilt.  poll is used if it cannot be set up. */
+#if defined(USE_POLL) && defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#define EPOLL_MAX_EVENTS 64
+#endif
+
+#if defined(__linux__) && !defined(NO_TIMERFD)
+#define USE_TIMERFD
+#include <sys/timerfd.h>
+#endif
+
 #include "console.h"
 #include "libvnc/libvnc.h"
 #include "libvnc/libtextterm.h"
@@ -49,14 +63,10 @@
 #define FONTH	16
 #define FONTW	8
 
-char vncpasswd[64];
-unsigned char challenge[AUTHCHALLENGESIZE];
-
-DisplayState display_state;
-TextDisplayState text_display_state;
 int do_log;
 
 static int dump_cells = 0;
+static int dump_stats = 0;
 
 struct iohandler {
     int fd;
@@ -64,16 +74,31 @@ struct iohandler {
     void (*fd_write)(void *);
     void (*fd_error)(void *);
     void *opaque;
-    int enabled;
+    int index;			/* in active_handlers */
+    uint64_t generation;	/* handler_generation when registered */
 #ifdef USE_POLL
-    struct pollfd *pollfd;
+    struct pollfd *pollfd;	/* NULL until the pollfds are rebuilt */
+#endif
+#ifdef USE_EPOLL
+    uint32_t events;		/* registered with epoll_fd */
 #endif
-    struct iohandler *next;
 };
 
-struct iohandler *iohandlers = NULL;
+/* Handlers are found by fd in fd_handlers, and are also packed into
+   active_handlers for building the poll set.  A handler is freed as
+   soon as it is unregistered, so dispatch looks each ready fd up
+   again rather than holding on to its handler across callbacks, and
+   skips handlers registered after the wait, whose fd number may have
+   been reused from one that was closed. */
+static struct iohandler **fd_handlers = NULL;
+static int max_fd_handlers = 0;
+static struct iohandler **active_handlers = NULL;
 static int nr_handlers = 0;
 static int handlers_updated = 1;
+static uint64_t handler_generation = 0;
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+#endif
 
 enum privsep_opcode {
     privsep_op_statefile_completed
@@ -81,71 +106,278 @@ enum privsep_opcode {
 
 static void _write_port_to_xenstore(char *xenstore_path, char *type, int port);
 
+#ifdef USE_EPOLL
+static void
+epoll_update(struct iohandler *ioh)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if (ioh->fd_read)
+	events |= EPOLLIN;
+    if (ioh->fd_write)
+	events |= EPOLLOUT;
+    if (events == ioh->events)
+	return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = ioh->fd;
+    if (events == 0)
+	/* fails harmlessly if the fd is already closed */
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ioh->fd, &ev);
+    else if (ioh->events == 0 ||
+	     /* closed and reopened since it was registered */
+	     (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ioh->fd, &ev) == -1 &&
+	      errno == ENOENT)) {
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ioh->fd, &ev) == -1)
+	    err(1, "epoll_ctl");
+    }
+    ioh->events = events;
+}
+#endif
+
+/* The handler's callbacks have changed: update what is waited for */
+static void
+update_interest(struct iohandler *ioh)
+{
+#ifdef USE_EPOLL
+    if (epoll_fd != -1) {
+	epoll_update(ioh);
+	return;
+    }
+#endif
+    handlers_updated = 1;
+}
+
+static struct iohandler *
+lookup_fd_handler(int fd)
+{
+    if (fd < 0 || fd >= max_fd_handlers)
+	return NULL;
+    return fd_handlers[fd];
+}
+
+static struct iohandler *
+alloc_fd_handler(int fd)
+{
+    struct iohandler *ioh, **handlers;
+    int n;
+
+    if (fd >= max_fd_handlers) {
+	n = max_fd_handlers ? max_fd_handlers : 16;
+	while (n <= fd)
+	    n *= 2;
+	handlers = realloc(fd_handlers, n * sizeof(fd_handlers[0]));
+	if (handlers == NULL)
+	    return NULL;
+	memset(handlers + max_fd_handlers, 0,
+	       (n - max_fd_handlers) * sizeof(fd_handlers[0]));
+	fd_handlers = handlers;
+	handlers = realloc(active_handlers, n * sizeof(active_handlers[0]));
+	if (handlers == NULL)
+	    return NULL;
+	active_handlers = handlers;
+	max_fd_handlers = n;
+    }
+
+    ioh = calloc(1, sizeof(struct iohandler));
+    if (ioh == NULL)
+	return NULL;
+    ioh->fd = fd;
+    ioh->index = nr_handlers;
+    ioh->generation = ++handler_generation;
+    active_handlers[nr_handlers++] = ioh;
+    fd_handlers[fd] = ioh;
+    return ioh;
+}
+
+static void
+free_fd_handler(struct iohandler *ioh)
+{
+    struct iohandler *last = active_handlers[--nr_handlers];
+
+    ioh->fd_read = NULL;
+    ioh->fd_write = NULL;
+    update_interest(ioh);
+    active_handlers[ioh->index] = last;
+    last->index = ioh->index;
+    fd_handlers[ioh->fd] = NULL;
+    free(ioh);
+}
+
 int
 set_fd_handler(int fd, int (*fd_read_poll)(void *), void (*fd_read)(void *),
 	       void (*fd_write)(void *), void *opaque)
 {
-    struct iohandler **pioh = &iohandlers;
+    struct iohandler *ioh = lookup_fd_handler(fd);
 
-    while (*pioh) {
-	if ((*pioh)->fd == fd)
-	    break;
-	pioh = &(*pioh)->next;
+    if (fd_read == NULL && fd_write == NULL) {
+	if (ioh)
+	    free_fd_handler(ioh);
+	return 0;
     }
-    if (*pioh == NULL) {
-	*pioh = calloc(1, sizeof(struct iohandler));
-	if (*pioh == NULL)
+    if (ioh == NULL) {
+	ioh = alloc_fd_handler(fd);
+	if (ioh == NULL)
 	    return -1;
-	(*pioh)->fd = fd;
-	nr_handlers++;
     }
-    (*pioh)->fd_read = fd_read;
-    (*pioh)->fd_write = fd_write;
-    (*pioh)->opaque = opaque;
-    (*pioh)->enabled = (fd_read || fd_write);
-    if (!(*pioh)->enabled) {
-	(*pioh)->pollfd = NULL;
-	(*pioh)->fd_error = NULL;
+    ioh->fd_read = fd_read;
+    ioh->fd_write = fd_write;
+    ioh->opaque = opaque;
+    update_interest(ioh);
+    return 0;
+}
+
+/* Run the callbacks for the events on fd, each of which may close or
+   re-register any fd.  The events are dropped if fd was registered
+   anew since the wait, at wait_generation.  Returns -1 if the fd
+   failed, in which case it is no longer waited on. */
+static int
+handle_fd_events(int fd, int revents, uint64_t wait_generation)
+{
+    struct iohandler *ioh = lookup_fd_handler(fd);
+    uint64_t generation;
+
+    if (ioh == NULL || ioh->generation > wait_generation)
+	return 0;
+    /* a callback may close fd and a new handler take its number */
+    generation = ioh->generation;
+    if (revents & (POLLERR|POLLHUP|POLLNVAL)) {
+	if (ioh->fd_error)
+	    ioh->fd_error(ioh->opaque);
+	ioh = lookup_fd_handler(fd);
+	if (ioh && ioh->generation == generation)
+	    free_fd_handler(ioh);
+	return -1;
     }
-    handlers_updated = 1;
+    if (revents & POLLOUT && ioh->fd_write)
+	ioh->fd_write(ioh->opaque);
+    ioh = lookup_fd_handler(fd);
+    if (ioh && ioh->generation == generation &&
+	revents & POLLIN && ioh->fd_read)
+	ioh->fd_read(ioh->opaque);
     return 0;
 }
 
 int
 set_fd_error_handler(int fd, void (*fd_error)(void *))
 {
-    struct iohandler **pioh = &iohandlers;
+    struct iohandler *ioh = lookup_fd_handler(fd);
 
-    while (*pioh) {
-	if ((*pioh)->fd == fd)
-	    break;
-	pioh = &(*pioh)->next;
-    }
-    if (*pioh == NULL)
+    if (ioh == NULL)
 	return 1;
-    (*pioh)->fd_error = fd_error;
+    ioh->fd_error = fd_error;
     return 0;
 }
 
+/* Timers are kept in a binary min-heap on their timeout.  Where there
+   is timerfd, it is armed for the earliest so that the loop wakes at
+   exactly that time; otherwise it bounds the poll timeout, which only
+   has millisecond resolution. */
 struct timer {
     void (*callback)(void *);
     void *opaque;
-    uint64_t timeout;
-    struct timer *next;
+    uint64_t timeout;		/* get_clock time, UINT64_MAX if unset */
+    int index;			/* in timer_heap, -1 if unset */
 };
 
-static struct timer *timers = NULL;
-static struct timer **timers_tail = &timers;
+static struct timer **timer_heap = NULL;
+static int nr_timers = 0;
+static int max_timers = 0;
+#ifdef USE_TIMERFD
+static int timer_fd = -1;
+static uint64_t timer_fd_timeout = UINT64_MAX;	/* what it is armed for */
+#endif
 
+/* Monotonic, in microseconds */
 uint64_t
 get_clock(void)
 {
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL) != 0)
-	err(1, "gettimeofday");
-    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+	err(1, "clock_gettime");
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+timer_heap_set(int i, struct timer *t)
+{
+    timer_heap[i] = t;
+    t->index = i;
+}
+
+/* Move the timer at i to where its timeout belongs */
+static void
+timer_heap_fix(int i)
+{
+    struct timer *t = timer_heap[i];
+    int c;
+
+    while (i > 0 && timer_heap[(i - 1) / 2]->timeout > t->timeout) {
+	timer_heap_set(i, timer_heap[(i - 1) / 2]);
+	i = (i - 1) / 2;
+    }
+    for (;;) {
+	c = 2 * i + 1;
+	if (c >= nr_timers)
+	    break;
+	if (c + 1 < nr_timers &&
+	    timer_heap[c + 1]->timeout < timer_heap[c]->timeout)
+	    c++;
+	if (timer_heap[c]->timeout >= t->timeout)
+	    break;
+	timer_heap_set(i, timer_heap[c]);
+	i = c;
+    }
+    timer_heap_set(i, t);
+}
+
+static void
+timer_heap_remove(struct timer *t)
+{
+    int i = t->index;
+
+    t->index = -1;
+    t->timeout = UINT64_MAX;
+    if (--nr_timers == i)
+	return;
+    timer_heap_set(i, timer_heap[nr_timers]);
+    timer_heap_fix(i);
 }
 
+#ifdef USE_TIMERFD
+static void
+timer_fd_arm(void)
+{
+    struct itimerspec its;
+    uint64_t timeout = nr_timers ? timer_heap[0]->timeout : UINT64_MAX;
+
+    if (timer_fd == -1 || timeout == timer_fd_timeout)
+	return;
+    memset(&its, 0, sizeof(its));
+    if (timeout != UINT64_MAX) {
+	/* zero would disarm it */
+	if (timeout == 0)
+	    timeout = 1;
+	its.it_value.tv_sec = timeout / 1000000;
+	its.it_value.tv_nsec = (timeout % 1000000) * 1000;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	err(1, "timerfd_settime");
+    timer_fd_timeout = timeout;
+}
+
+/* the timers themselves are run by the main loop once it wakes */
+static void
+timer_fd_read(void *opaque)
+{
+    uint64_t expirations;
+
+    read(timer_fd, &expirations, sizeof(expirations));
+}
+#endif
+
 void *
 init_timer(void (*callback)(void *), void *opaque)
 {
@@ -157,8 +389,7 @@ init_timer(void (*callback)(void *), void *opaque)
     t->callback = callback;
     t->opaque = opaque;
     t->timeout = UINT64_MAX;
-    *timers_tail = t;
-    timers_tail = &t->next;
+    t->index = -1;
 
     return t;
 }
@@ -167,30 +398,69 @@ int
 set_timer(void *_t, uint64_t timeout)
 {
     struct timer *t = _t;
-    struct timer **o = NULL;
-    struct timer **n = timers_tail;
-    struct timer **c = &timers;
-
-    t->timeout = timeout;
-    while (*c && (o == NULL || n == NULL)) {
-	if ((*c)->timeout >= timeout && n == timers_tail)
-	    n = c;
-	if (*c == t)
-	    o = c;
-	c = &(*c)->next;
-    }
-    if (n != o) {
-	*o = t->next;
-	if (*o == NULL)
-	    timers_tail = o;
-	t->next = *n;
-	*n = t;
-	if (t->next == NULL)
-	    timers_tail = &t->next;
+
+    if (timeout == UINT64_MAX) {
+	if (t->index != -1)
+	    timer_heap_remove(t);
+    } else {
+	if (t->index == -1) {
+	    if (nr_timers == max_timers) {
+		struct timer **heap;
+
+		heap = realloc(timer_heap,
+			       (max_timers + 8) * sizeof(timer_heap[0]));
+		if (heap == NULL)
+		    return -1;
+		timer_heap = heap;
+		max_timers += 8;
+	    }
+	    timer_heap_set(nr_timers++, t);
+	}
+	t->timeout = timeout;
+	timer_heap_fix(t->index);
     }
+#ifdef USE_TIMERFD
+    timer_fd_arm();
+#endif
     return 0;
 }
 
+static void
+run_timers(void)
+{
+    struct timer *t;
+    uint64_t now = get_clock();
+
+    while (nr_timers && timer_heap[0]->timeout <= now) {
+	t = timer_heap[0];
+	timer_heap_remove(t);
+	t->callback(t->opaque);
+    }
+#ifdef USE_TIMERFD
+    timer_fd_arm();
+#endif
+}
+
+/* How long the loop may wait for fds, in milliseconds */
+static int
+timers_poll_timeout(void)
+{
+    uint64_t now, timeout;
+
+#ifdef USE_TIMERFD
+    if (timer_fd != -1)
+	return 60000;
+#endif
+    if (nr_timers == 0)
+	return 60000;
+    now = get_clock();
+    if (timer_heap[0]->timeout <= now)
+	return 0;
+    /* round up, so as not to wake before the timer is due */
+    timeout = (timer_heap[0]->timeout - now + 999) / 1000;
+    return timeout > 60000 ? 60000 : timeout;
+}
+
 void kbd_put_keycode(int keycode)
 {
 }
@@ -206,44 +476,102 @@ hw_update(void *s)
 void
 hw_invalidate(void *s)
 {
-    // CharDriverState *console = s;
+    CharDriverState *console = s;
 
-    console_select(0);
+    console_select(console, 0);
 }
 
 struct process {
     int fd;
+    DisplayState *ds;
     CharDriverState *console;
     TextDisplayState *tds;
     pid_t pid;
 };
 
+/* Output from the pty is read in chunks of INPUT_CHUNK, each handed to
+   the console in one go, until the fd is drained or INPUT_BUDGET bytes
+   have been taken in one wakeup, so a flood can't starve the clients.
+   A pty read returns at most a few KiB, so a chunk gathers many of them
+   into one console update; the budget bounds a wakeup to a few chunks,
+   under a tenth of a second of console rendering. */
+#define INPUT_CHUNK (64 * 1024)
+#define INPUT_BUDGET (4 * INPUT_CHUNK)
+
+static uint8_t input_buf[INPUT_CHUNK];
+
+static int
+read_chunk(int fd)
+{
+    int len = 0;
+    ssize_t count;
+
+    while (len < INPUT_CHUNK) {
+	count = read(fd, input_buf + len, INPUT_CHUNK - len);
+	if (count < 0 && errno == EINTR)
+	    continue;
+	if (count <= 0)
+	    break;
+	len += count;
+    }
+    return len;
+}
+
+static void
+drain_input(int fd, DisplayState *ds, CharDriverState *console,
+	    TextDisplayState *tds)
+{
+    int budget = INPUT_BUDGET;
+    int len;
+
+    while (budget > 0) {
+	len = read_chunk(fd);
+	if (len == 0)
+	    break;
+	ds->damage_time = get_clock();
+	console->chr_write(console, input_buf, len);
+	ds->damage_time = 0;
+	if (tds)
+	    tds->chr_write(tds, input_buf, len);
+	if (len < INPUT_CHUNK)
+	    break;
+	budget -= len;
+    }
+}
+
 void
 stdin_to_process(void *opaque)
 {
     struct process *p = opaque;
-    uint8_t buf[16];
-    int count;
-
-    count = read(0, buf, 16);
-    if (count > 0)
-	write(p->fd, buf, count);
+    int len, pos = 0;
+    ssize_t count;
+
+    len = read(0, input_buf, INPUT_CHUNK);
+    while (pos < len) {
+	count = write(p->fd, input_buf + pos, len - pos);
+	if (count < 0 && errno == EINTR)
+	    continue;
+	if (count < 0 && errno == EAGAIN) {
+	    /* the fd is non-blocking; wait for the process to catch up
+	       rather than drop the rest of the input */
+	    struct pollfd pfd = { .fd = p->fd, .events = POLLOUT };
+
+	    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		break;
+	    continue;
+	}
+	if (count <= 0)
+	    break;
+	pos += count;
+    }
 }
 
 void
 process_read(void *opaque)
 {
     struct process *p = opaque;
-    uint8_t buf[16];
-    int count;
 
-    count = read(p->fd, buf, 16);
-    if (count > 0)
-    {
-        p->console->chr_write(p->console, buf, count);
-        if (p->tds)
-            p->tds->chr_write(p->tds, buf, count);
-    }
+    drain_input(p->fd, p->ds, p->console, p->tds);
 }
 
 static void _configure_input_fd(CharDriverState *console,
@@ -251,6 +579,8 @@ static void _configure_input_fd(CharDriverState *console,
                                 int fd, void (*fd_read)(void *), void *opaque)
 {
     fcntl(fd, F_SETFL, O_NONBLOCK);
+    /* so that no other terminal's command gets hold of it */
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
     set_fd_handler(fd, NULL, fd_read, NULL, opaque);
     console_set_input(console, fd, opaque);
     if (tds)
@@ -259,7 +589,7 @@ static void _configure_input_fd(CharDriverState *console,
 
 /* Not safe after we've dropped privileges */
 struct process *
-run_process(CharDriverState *console, TextDisplayState *tds,
+run_process(DisplayState *ds, CharDriverState *console, TextDisplayState *tds,
             const char *filename, char *const argv[], char *const envp[])
 {
     struct process *p;
@@ -269,6 +599,7 @@ run_process(CharDriverState *console, TextDisplayState *tds,
     if (p == NULL)
 	err(1, "malloc");
 
+    p->ds = ds;
     p->console = console;
     p->tds = tds;
 
@@ -299,7 +630,12 @@ end_process(struct process *p)
 static void
 handle_sigchld(int signo)
 {
-    wait(NULL);
+    int saved_errno = errno;
+
+    /* exits at the same time make for one signal */
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+	;
+    errno = saved_errno;
     signal(SIGCHLD, handle_sigchld);
 }
 
@@ -315,8 +651,15 @@ handle_sigusr2(int signo)
     do_log = ~do_log;
 }
 
+static void
+handle_sighup(int signo)
+{
+    dump_stats = 1;
+}
+
 struct pty {
     int fd;
+    DisplayState *ds;
     CharDriverState *console;
     TextDisplayState *tds;
 };
@@ -325,20 +668,13 @@ void
 pty_read(void *opaque)
 {
     struct pty *pty = opaque;
-    uint8_t buf[16];
-    int count;
 
-    count = read(pty->fd, buf, 16);
-    if (count > 0)
-    {
-    	pty->console->chr_write(pty->console, buf, count);
-        if (pty->tds != NULL)
-            pty->tds->chr_write(pty->tds, buf, count);
-    }
+    drain_input(pty->fd, pty->ds, pty->console, pty->tds);
 }
 
 static struct pty *
-connect_pty(char *pty_path, CharDriverState *console, TextDisplayState *tds)
+connect_pty(char *pty_path, DisplayState *ds, CharDriverState *console,
+            TextDisplayState *tds)
 {
     struct pty *pty;
 
@@ -349,6 +685,7 @@ connect_pty(char *pty_path, CharDriverState *console, TextDisplayState *tds)
     pty->fd = open(pty_path, O_RDWR | O_NOCTTY);
     if (pty->fd == -1)
 	err(1, "open");
+    pty->ds = ds;
     pty->console = console;
     pty->tds = tds;
 
@@ -357,19 +694,52 @@ connect_pty(char *pty_path, CharDriverState *console, TextDisplayState *tds)
     return pty;
 }
 
+/* A terminal: its display, console and what feeds it.  There is one
+   per process, except in daemon mode where there is one for each line
+   of the daemon file. */
 struct vncterm
 {
+    DisplayState ds;
+    TextDisplayState text_ds;
     CharDriverState *console;
     TextDisplayState *tds;
     struct process *process;
     struct pty *pty;
-    char *xenstore_path;
+    char *xenstore_path;	/* the tty node being watched */
+    int display;
+    int text_display;
+
+    /* options */
+    char *pty_path;
+    char *title;
+    char *statefile;
+    char *vnclisten;
+    char *vncvieweroptions;
+    char *xenstore_dir;
+    char **argv;		/* command, in cmd mode */
+    int exit_on_eof;
+    int restart;
+    int cmd_mode;
+    int vncviewer;
+    int enable_textterm;
+    int max_fps;
+
+    int restart_needed;
+    int exit_when_all_disconnect;
+    int finished;		/* ended, and its clients have gone */
+
+    struct vncterm *next;
 };
 
+static struct vncterm *vncterms;
+/* some terminal has a restart or exit pending */
+static int vncterms_pending;
+
 #ifndef NXENSTORE
 void
-read_xs_watch(struct xs_handle *xs, struct vncterm *vncterm)
+read_xs_watch(struct xs_handle *xs)
 {
+    struct vncterm *vncterm;
     char **vec, *pty_path = NULL;
     unsigned int num;
 
@@ -377,14 +747,19 @@ read_xs_watch(struct xs_handle *xs, struct vncterm *vncterm)
     if (vec == NULL)
 	return;
 
-    if (strcmp(vncterm->xenstore_path, vec[XS_WATCH_PATH]))
+    for (vncterm = vncterms; vncterm; vncterm = vncterm->next)
+	if (vncterm->xenstore_path && vncterm->pty == NULL &&
+	    !strcmp(vncterm->xenstore_path, vec[XS_WATCH_PATH]))
+	    break;
+    if (vncterm == NULL)
 	goto out;
 
     pty_path = xs_read(xs, XBT_NULL, vncterm->xenstore_path, NULL);
     if (pty_path == NULL)
 	goto out;
 
-    vncterm->pty = connect_pty(pty_path, vncterm->console, vncterm->tds);
+    vncterm->pty = connect_pty(pty_path, &vncterm->ds, vncterm->console,
+                               vncterm->tds);
 
     xs_unwatch(xs, vncterm->xenstore_path, "tty");
 
@@ -427,8 +802,9 @@ static gid_t vncterm_gid;
 static uid_t vncterm_uid;
 #ifndef NXENSTORE
 struct xs_handle *xs = NULL;
-char *xenstore_path = NULL;
 #endif
+static int daemon_mode;
+static int stay_root = 0;
 
 static void clean_exit(int ret)
 {
@@ -487,12 +863,13 @@ must_write(int fd, const void *buf, size_t n)
     }
 }
 
-static void xenstore_write_statefile(const char *filepath)
+static void xenstore_write_statefile(const char *xenstore_dir,
+                                     const char *filepath)
 {
     int ret;
     char *path = NULL;
 
-    ret = asprintf(&path, "%s/statefile", xenstore_path);
+    ret = asprintf(&path, "%s/statefile", xenstore_dir);
     if (ret < 0)
         err(1, "asprintf");
     ret = xs_write(xs, XBT_NULL, path, filepath, strlen(filepath));
@@ -518,19 +895,21 @@ static void privsep_xenstore_statefile()
     must_read(parent_fd, filepath, l);
     filepath[l] = 0;
 
-    xenstore_write_statefile(filepath);
+    /* there is only one terminal when running privsep */
+    xenstore_write_statefile(vncterms->xenstore_dir, filepath);
 
 done:
     free(filepath);
 }
 
-static void privsep_statefile_completed(const char *name)
+static void privsep_statefile_completed(const char *xenstore_dir,
+                                        const char *name)
 {
     enum privsep_opcode cmd;
     int l;
 
     if (privsep_fd <= 0) {
-        xenstore_write_statefile(name);
+        xenstore_write_statefile(xenstore_dir, name);
         return;
     }
     cmd = privsep_op_statefile_completed;
@@ -582,49 +961,46 @@ static void parent_handle_sigchld(int num)
         signal(SIGCHLD, parent_handle_sigchld);
 }
 
-int
-main(int argc, char **argv, char **envp)
+static char **newenvp = NULL;
+
+/* The environment for commands run in cmd mode */
+static void
+make_cmd_env(char **envp)
 {
-    DisplayState *ds;
-    TextDisplayState *tds;
-    struct vncterm *vncterm;
-    struct sockaddr_in sa, sat;
-    int display;
-    int text_display;
-    struct iohandler *ioh, *next;
-    struct timer *t;
-    char **newenvp = NULL;	/* sigh gcc */
     int nenv;
-    uint64_t now;
-    short revents;
-    int ret, timeout;
-    int nfds = 0;
-    char *pty_path = NULL;
-    char *title = "XenServer Virtual Terminal";
-    char *statefile = NULL;
-    char *vnclisten = NULL;
-    char *vncvieweroptions = NULL;
-    int exit_on_eof = 1;
-    int restart = 0;
-    int restart_needed = 1;
-    int cmd_mode = 0;
-    int exit_when_all_disconnect = 0;
-    int stay_root = 0;
-    int vncviewer = 0;
-    int enable_textterm = 0;
 
-#ifdef USE_POLL
-    struct pollfd *pollfds = NULL;
-    int max_pollfds = 0;
-#else
-    fd_set rdset, wrset, exset, rdset_m, wrset_m, exset_m;
-    struct timeval timeout_tv;
-#endif
+    if (newenvp)
+	return;
 
-    vncterm = calloc(1, sizeof(struct vncterm));
-    if (vncterm == NULL)
+    /* count env variables */
+    for (nenv = 0; envp[nenv]; nenv++);
+
+    newenvp = malloc(++nenv * sizeof(char *));
+    if (newenvp == NULL)
 	err(1, "malloc");
 
+    for (nenv = 0; envp[nenv]; nenv++) {
+	if (!strncmp(envp[nenv], "TERM=", 5))
+	    newenvp[nenv] = "TERM=linux";
+	else
+	    newenvp[nenv] = envp[nenv];
+    }
+    newenvp[nenv] = NULL;
+}
+
+static char *daemon_file = NULL;
+
+/* Parses the options for a terminal into vt.  Used both for the command
+   line and for each line of the daemon file. */
+static void
+parse_options(struct vncterm *vt, int argc, char **argv)
+{
+#if defined(__APPLE__)
+    optreset = 1;
+    optind = 1;
+#else
+    optind = 0;
+#endif
     while (1) {
 	int c;
 	static struct option long_options[] = {
@@ -639,61 +1015,140 @@ main(int argc, char **argv, char **envp)
         {"vncviewer", 2, 0, 'V'},
             {"loadstate", 1, 0, 'l'},
             {"text", 0, 0, 'T'},
+            {"max-fps", 1, 0, 'f'},
+            {"daemon", 1, 0, 'd'},
 	    {0, 0, 0, 0}
 	};
 
-	c = getopt_long(argc, argv, "+cp:rst:x:v:SV::l:T", long_options, NULL);
+	c = getopt_long(argc, argv, "+cp:rst:x:v:SV::l:Tf:d:", long_options,
+			NULL);
 	if (c == -1)
 	    break;
 
 	switch (c) {
         case 'l':
-            statefile = strdup(optarg);
+            vt->statefile = strdup(optarg);
+            break;
+        case 'f': {
+            char *r;
+            vt->max_fps = strtol(optarg, &r, 10);
+            if (r[0] != '\0' || optarg[0] == '\0' || vt->max_fps <= 0) {
+                fprintf(stderr, "incorrect frame rate\n");
+                exit(1);
+            }
+            break;
+        }
+        case 'd':
+            if (vt != vncterms) {
+                fprintf(stderr, "--daemon in daemon file\n");
+                exit(1);
+            }
+            daemon_file = strdup(optarg);
             break;
 	case 'c':
-	    cmd_mode = 1;
+	    vt->cmd_mode = 1;
             /* We sometimes re-exec ourselves when run in cmd mode,
                and expect to have root when we come back.  We
                therefore can't drop privileges in command mode. */
             stay_root = 1;
 	    break;
 	case 'p':
-	    pty_path = strdup(optarg);
+	    vt->pty_path = strdup(optarg);
 	    break;
 	case 'r':
-	    restart = 1;
+	    vt->restart = 1;
 	    break;
 	case 's':
-	    exit_on_eof = 0;
+	    vt->exit_on_eof = 0;
 	    break;
 	case 't':
-	    title = strdup(optarg);
+	    vt->title = strdup(optarg);
 	    break;
         case 'S':
             stay_root = 1;
             break;
 	case 'x':
 #ifndef NXENSTORE
-	    xenstore_path = strdup(optarg);
+	    vt->xenstore_dir = strdup(optarg);
 #endif
 	    break;
 	case 'v':
-	    vnclisten = strdup(optarg);
+	    vt->vnclisten = strdup(optarg);
 	    break;
 	case 'V':
-	    vncviewer = 1;
+	    vt->vncviewer = 1;
         if (optarg != NULL)
-            vncvieweroptions = strdup(optarg);
+            vt->vncvieweroptions = strdup(optarg);
         case 'T':
-            enable_textterm = 1;
+            vt->enable_textterm = 1;
             break;
         break;
 	}
     }
 
-    setlocale(LC_ALL, "en_US.UTF-8");
-    ds = &display_state;
-    memset(ds, 0, sizeof(display_state));
+    if (optind < argc)
+	vt->argv = argv + optind;
+}
+
+/* Reads the daemon file, each line of which holds the options for one
+   terminal, in addition to those given on the command line. */
+static void
+read_daemon_file(const char *path, struct vncterm *defaults)
+{
+    struct vncterm *vt, **tail = &vncterms;
+    char line[1024];
+    wordexp_t we;
+    FILE *f;
+    char *p;
+    size_t len;
+    int lineno = 0;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+	err(1, "%s", path);
+
+    vncterms = NULL;
+    while (fgets(line, sizeof(line), f) != NULL) {
+	lineno++;
+	len = strlen(line);
+	if (len > 0 && line[len - 1] == '\n')
+	    line[len - 1] = '\0';
+	else if (!feof(f) && getc(f) != EOF)
+	    errx(1, "%s:%d: line too long", path, lineno);
+	p = line + strspn(line, " \t");
+	if (*p == '\0' || *p == '#')
+	    continue;
+
+	we.we_offs = 1;
+	if (wordexp(line, &we, WRDE_DOOFFS | WRDE_NOCMD) != 0)
+	    errx(1, "%s:%d: cannot parse", path, lineno);
+	we.we_wordv[0] = "vncterm";
+
+	vt = malloc(sizeof(struct vncterm));
+	if (vt == NULL)
+	    err(1, "malloc");
+	*vt = *defaults;
+	vt->next = NULL;
+	/* the words are kept, as vt points into them */
+	parse_options(vt, we.we_wordc + 1, we.we_wordv);
+
+	*tail = vt;
+	tail = &vt->next;
+    }
+    fclose(f);
+
+    if (vncterms == NULL)
+	errx(1, "%s: no terminals", path);
+}
+
+/* Sets up the display and console for vt, and connects its input */
+static void
+start_vncterm(struct vncterm *vt, char **envp)
+{
+    DisplayState *ds = &vt->ds;
+    TextDisplayState *tds = &vt->text_ds;
+    struct sockaddr_in sa, sat;
+
     ds->set_fd_handler = set_fd_handler;
     ds->set_fd_error_handler = set_fd_error_handler;
     ds->init_timer = init_timer;
@@ -702,9 +1157,7 @@ main(int argc, char **argv, char **envp)
     ds->kbd_put_keycode = kbd_put_keycode;
     ds->kbd_put_keysym = kbd_put_keysym;
 
-    tds = &text_display_state;
-    memset(tds, 0, sizeof(text_display_state));
-    if (enable_textterm) {
+    if (vt->enable_textterm) {
         tds->set_fd_handler = set_fd_handler;
         tds->set_fd_error_handler = set_fd_error_handler;
         tds->init_timer = init_timer;
@@ -712,10 +1165,13 @@ main(int argc, char **argv, char **envp)
         tds->set_timer = set_timer;
     }
 
-    memset(&sa.sin_addr, 0, sizeof(sa.sin_addr));
-    if (vnclisten != NULL)
+    memset(&sa, 0, sizeof(sa));
+    if (vt->vnclisten != NULL)
     {
-        char *c;
+        char *vnclisten, *c;
+        vnclisten = strdup(vt->vnclisten);
+        if (vnclisten == NULL)
+            err(1, "strdup");
         c = strchr(vnclisten, ':');
         if (c != NULL) {
             int port;
@@ -734,6 +1190,7 @@ main(int argc, char **argv, char **envp)
             if (!inet_aton(vnclisten, &(sa.sin_addr))) err(1, "inet_aton");
             sa.sin_port = htons(0);
         }
+        free(vnclisten);
     } else {
         sa.sin_port = htons(0);
     }
@@ -745,33 +1202,40 @@ main(int argc, char **argv, char **envp)
     sat.sin_addr = sa.sin_addr;
     sat.sin_port = sa.sin_port;
 
-    display = vnc_display_init(ds, (struct sockaddr *)&sa, 1, title, NULL, 
-		COLS * FONTW, LINES * FONTH );
-    vncterm->console = text_console_init(ds);
-
-    if (enable_textterm) {
-        text_display = text_term_display_init(tds, (struct sockaddr *)&sat, 1,
-                                              title);
-        vncterm->tds = tds;
+    vt->display = vnc_display_init(ds, (struct sockaddr *)&sa, 1, vt->title,
+                                   NULL, COLS * FONTW, LINES * FONTH );
+    if (vt->max_fps)
+        vnc_set_max_fps(ds, vt->max_fps);
+    vt->console = text_console_init(ds);
+    if (vt->console == NULL)
+        errx(1, "cannot create console");
+
+    if (vt->enable_textterm) {
+        vt->text_display = text_term_display_init(tds,
+                                                  (struct sockaddr *)&sat, 1,
+                                                  vt->title);
+        vt->tds = tds;
     }
     else {
-        text_display = -1;
-        vncterm->tds = NULL;
+        vt->text_display = -1;
+        vt->tds = NULL;
     }
 
-    if (statefile != NULL) {
-        load_console_from_file(vncterm->console, statefile);
+    if (vt->statefile != NULL) {
+        load_console_from_file(vt->console, vt->statefile);
     }
-    
-    if (vncviewer == 1) {
+
+    if (vt->vncviewer == 1) {
         int i, l = 0;
         int count = 0;
         char **opts;
+        char *vncvieweroptions = NULL;
         char* vmuuid;
         char name[50];
         char port[10];
 
-        if (vncvieweroptions != NULL) {
+        if (vt->vncvieweroptions != NULL) {
+            vncvieweroptions = strdup(vt->vncvieweroptions);
             l = strlen(vncvieweroptions);
             for (i = 0; i < l; i++) {
                 if (vncvieweroptions[i] == ';') {
@@ -786,7 +1250,7 @@ main(int argc, char **argv, char **envp)
         count = 1;
         if (vncvieweroptions != NULL) {
             opts[count] = vncvieweroptions;
-            count++; 
+            count++;
             for (i = 0; i < l; i++) {
                 if (vncvieweroptions[i] == ';') {
                     vncvieweroptions[i] = '\0';
@@ -795,7 +1259,7 @@ main(int argc, char **argv, char **envp)
                 }
             }
         }
-        sprintf(port, ":%d", display);
+        sprintf(port, ":%d", vt->display);
         opts[count] = port;
         count++;
         opts[count] = "-name";
@@ -808,84 +1272,267 @@ main(int argc, char **argv, char **envp)
         opts[count] = NULL;
         vnc_start_viewer(opts);
         free(opts);
+        free(vncvieweroptions);
     }
 #if 0
     {
 	char *msg = "Hello World\n\r";
-	vncterm->console->chr_write(vncterm->console, (uint8_t *)msg,
-				    strlen(msg));
+	vt->console->chr_write(vt->console, (uint8_t *)msg, strlen(msg));
     }
 #endif
 
-    ds->mouse_opaque = vncterm->console;
+    ds->kbd_opaque = vt->console;
+
+    ds->mouse_opaque = vt->console;
     ds->mouse_is_absolute = mouse_is_absolute;
     ds->mouse_event = mouse_event;
 
-    ds->hw_opaque = vncterm->console;
+    ds->hw_opaque = vt->console;
     ds->hw_update = hw_update;
     ds->hw_invalidate = hw_invalidate;
 
 #ifndef NXENSTORE
-    if (xenstore_path && access("/proc/xen", F_OK))
-	xenstore_path = NULL;
+    if (vt->xenstore_dir && access("/proc/xen", F_OK))
+	vt->xenstore_dir = NULL;
 
-    if (xenstore_path) {
-	xs = xs_daemon_open();
+    if (vt->xenstore_dir) {
+	int ret;
+
+	if (xs == NULL)
+	    xs = xs_daemon_open();
 	if (xs == NULL)
 	    err(1, "xs_daemon_open");
 
-        _write_port_to_xenstore(xenstore_path, "vnc", display);
-        if (enable_textterm)
-            _write_port_to_xenstore(xenstore_path, "tc", text_display);
+        _write_port_to_xenstore(vt->xenstore_dir, "vnc", vt->display);
+        if (vt->enable_textterm)
+            _write_port_to_xenstore(vt->xenstore_dir, "tc", vt->text_display);
 
-	if (!cmd_mode) {
-	    ret = asprintf(&vncterm->xenstore_path, "%s/tty", xenstore_path);
+	if (!vt->cmd_mode) {
+	    ret = asprintf(&vt->xenstore_path, "%s/tty", vt->xenstore_dir);
 	    if (ret < 0)
 		err(1, "asprintf");
 
-	    ret = xs_watch(xs, vncterm->xenstore_path, "tty");
+	    ret = xs_watch(xs, vt->xenstore_path, "tty");
 	    if (!ret)
 		err(1, "xs_watch");
 
-            while (vncterm->pty == NULL)
-                read_xs_watch(xs, vncterm);
+            /* a daemon picks the pty up from the main loop instead */
+            while (!daemon_mode && vt->pty == NULL)
+                read_xs_watch(xs);
 	}
     }
     else /* fallthrough */
 #endif
-    if (!pty_path)
-	cmd_mode = 1;
+    if (!vt->pty_path)
+	vt->cmd_mode = 1;
 
-    if (cmd_mode) {
-	/* count env variables */
-	for (nenv = 0; envp[nenv]; nenv++);
+    if (vt->cmd_mode) {
+	make_cmd_env(envp);
 
-	newenvp = malloc(++nenv * sizeof(char *));
-	if (newenvp == NULL)
+	if (vt->argv == NULL) {
+	    vt->argv = calloc(2, sizeof(char *));
+	    if (vt->argv == NULL)
 		err(1, "malloc");
+	    vt->argv[0] = "/bin/bash";
+	}
 
-	for (nenv = 0; envp[nenv]; nenv++) {
-		if (!strncmp(envp[nenv], "TERM=", 5)) 
-			newenvp[nenv] = "TERM=linux";
-		else
-			newenvp[nenv] = envp[nenv];
+        stay_root = 1;
+	vt->restart_needed = 1;
+	vncterms_pending = 1;
+    }
+
+    if (vt->pty_path)
+	vt->pty = connect_pty(vt->pty_path, ds, vt->console, vt->tds);
+}
+
+/* Restarts commands and retires terminals whose input has gone, and
+   exits once none are left. */
+static void
+service_vncterms(void)
+{
+    struct vncterm *vt;
+    int pending = 0, live = 0;
+
+    for (vt = vncterms; vt; vt = vt->next) {
+	if (vt->restart_needed && vt->cmd_mode) {
+	    if (vt->process)
+		end_process(vt->process);
+	    vt->process = run_process(&vt->ds, vt->console, vt->tds,
+	                              vt->argv[0], vt->argv, newenvp);
+	    vt->restart_needed = 0;
 	}
-	newenvp[nenv] = NULL;
-
-	if (argc == optind) {
-	    argv = calloc(2, sizeof(char *));
-	    argv[0] = "/bin/bash";
-	    argc = 1;
-	} else {
-	    argv += optind;
-	    argc -= optind;
+
+	if (vt->exit_when_all_disconnect &&
+	    !nrof_clients_connected(vt->console)) {
+	    vt->exit_when_all_disconnect = 0;
+	    vt->finished = 1;
 	}
 
-        stay_root = 1;
+	if (vt->exit_when_all_disconnect)
+	    pending = 1;
+	if (!vt->finished)
+	    live++;
+    }
+    if (live == 0)
+	exit(0);
+    vncterms_pending = pending;
+}
+
+/* Called when fd has failed, which may be the input of a terminal */
+static void
+vncterm_input_closed(int fd)
+{
+    struct vncterm *vt;
+
+    for (vt = vncterms; vt; vt = vt->next) {
+	if (fd != console_input_fd(vt->console))
+	    continue;
+	vt->ds.dpy_close_vncviewer_connections(&vt->ds);
+	if (vt->restart)
+	    vt->restart_needed = 1;
+	else if (vt->exit_on_eof)
+	    vt->exit_when_all_disconnect = 1;
+	vncterms_pending = 1;
+	break;
+    }
+}
+
+static void
+dump_vncterm(struct vncterm *vt)
+{
+    char *filepath;
+    int ret;
+
+    if (strlen(root_directory))
+        ret = asprintf(&filepath, "vncterm.statefile");
+    else if (daemon_mode)
+        ret = asprintf(&filepath, "/tmp/vncterm.statefile.%d.%d", getpid(),
+                       vt->display);
+    else
+        ret = asprintf(&filepath, "/tmp/vncterm.statefile.%d", getpid());
+    if (ret < 0)
+        err(1, "asprintf");
+    if (daemon_mode && !strlen(root_directory)) {
+        /* the daemon lives long enough for its name in /tmp to be
+           guessed, so never follow or reuse what is already there;
+           a dump of our own from an earlier signal is replaced */
+        FILE *f;
+        int fd;
+
+        unlink(filepath);
+        fd = open(filepath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+                  O_CLOEXEC, 0600);
+        if (fd == -1 || (f = fdopen(fd, "wb")) == NULL) {
+            warn("%s", filepath);
+            if (fd != -1)
+                close(fd);
+            free(filepath);
+            return;
+        }
+        dump_console(vt->console, f);
+        fclose(f);
+    } else
+        dump_console_to_file(vt->console, filepath);
+
+#ifndef NXENSTORE
+    if (vt->xenstore_dir) {
+        char *fullfilepath;
+        if (filepath[0] != '/') {
+            ret = asprintf(&fullfilepath, "%s/vncterm.statefile", root_directory);
+            if (ret < 0)
+                err(1, "asprintf");
+        } else {
+            fullfilepath = malloc(strlen(filepath) + 1);
+            if (!fullfilepath)
+                err(1, "malloc");
+            memcpy (fullfilepath, filepath, strlen(filepath) + 1);
+        }
+        privsep_statefile_completed(vt->xenstore_dir, fullfilepath);
+        free(fullfilepath);
     }
+#endif
+    free(filepath);
+}
+
+#ifndef NXENSTORE
+static void
+xs_watch_read(void *opaque)
+{
+    read_xs_watch(xs);
+}
+#endif
+
+int
+main(int argc, char **argv, char **envp)
+{
+    struct vncterm *vncterm;
+    struct iohandler *ioh;
+    short revents;
+    int i, fd;
+    int ret, timeout;
+    int nfds = 0;
+    uint64_t wait_generation;
 
-    if (pty_path)
-	vncterm->pty = connect_pty(pty_path, vncterm->console, vncterm->tds);
+#ifdef USE_POLL
+    struct pollfd *pollfds = NULL;
+    int max_pollfds = 0;
+#endif
+#ifdef USE_EPOLL
+    struct epoll_event epoll_events[EPOLL_MAX_EVENTS];
+#endif
+#ifndef USE_POLL
+    fd_set rdset, wrset, exset, rdset_m, wrset_m, exset_m;
+    struct timeval timeout_tv;
+#endif
+
+    vncterm = calloc(1, sizeof(struct vncterm));
+    if (vncterm == NULL)
+	err(1, "malloc");
+    vncterm->title = "XenServer Virtual Terminal";
+    vncterm->exit_on_eof = 1;
+    vncterms = vncterm;
+
+#ifdef USE_EPOLL
+    /* before anything registers an fd handler */
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+	warn("epoll_create1, using poll");
+#endif
+#ifdef USE_TIMERFD
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+	warn("timerfd_create, using poll timeouts");
+    else
+	set_fd_handler(timer_fd, NULL, timer_fd_read, NULL, NULL);
+#endif
+
+    parse_options(vncterm, argc, argv);
+
+    /* In daemon mode, each line of the daemon file is a terminal, with
+       the command line options as defaults.  They share this process,
+       which stays root, so that fonts, keymaps and the main loop are
+       had once rather than per terminal. */
+    if (daemon_file) {
+	daemon_mode = 1;
+	stay_root = 1;
+	read_daemon_file(daemon_file, vncterm);
+	free(vncterm);
+    }
+
+    setlocale(LC_ALL, "en_US.UTF-8");
+    for (vncterm = vncterms; vncterm; vncterm = vncterm->next) {
+	start_vncterm(vncterm, envp);
+	if (daemon_mode)
+	    printf("%d %d\n", vncterm->display, vncterm->text_display);
+    }
+    if (daemon_mode)
+	fflush(stdout);
+    vncterm = vncterms;
+
+#ifndef NXENSTORE
+    if (daemon_mode && xs)
+	set_fd_handler(xs_fileno(xs), NULL, xs_watch_read, NULL, NULL);
+#endif
 
     if (stay_root) {
         /* warnx("not dropping root privileges"); */
@@ -895,8 +1542,8 @@ main(int argc, char **argv, char **envp)
         pw = getpwnam("vncterm_base");
         if (!pw)
             err(1, "getting uid/gid for vncterm_base");
-        vncterm_gid = pw->pw_gid + (unsigned short)display;
-        vncterm_uid = pw->pw_uid + (unsigned short)display;
+        vncterm_gid = pw->pw_gid + (unsigned short)vncterm->display;
+        vncterm_uid = pw->pw_uid + (unsigned short)vncterm->display;
 
         snprintf(root_directory, 64, "/var/xen/vncterm/%d", getpid());
         if (mkdir(root_directory, 00755) < 0) {
@@ -962,51 +1609,27 @@ main(int argc, char **argv, char **envp)
 
     signal(SIGUSR1, handle_sigusr1);
     signal(SIGUSR2, handle_sigusr2);
+    signal(SIGHUP, handle_sighup);
     signal(SIGCHLD, handle_sigchld);
 
     for (;;) {
-	if (restart_needed && cmd_mode) {
-	    if (vncterm->process)
-		end_process(vncterm->process);
-	    vncterm->process = run_process(vncterm->console, vncterm->tds,
-                                           argv[0], argv, newenvp);
-	    restart_needed = 0;
-	}
-
-	if (exit_when_all_disconnect && !nrof_clients_connected(vncterm->console))
-	    exit(0);
+	if (vncterms_pending)
+	    service_vncterms();
+
+        if (dump_stats) {
+            dump_stats = 0;
+            for (vncterm = vncterms; vncterm; vncterm = vncterm->next) {
+                if (daemon_mode)
+                    fprintf(stderr, "vncterm: display %d\n",
+                            vncterm->display);
+                vncterm->ds.dpy_dump_stats(&vncterm->ds, stderr);
+            }
+        }
 
         if (dump_cells) {
-            char *filepath;
-            int ret;
-
 	    dump_cells = 0;
-            if (strlen(root_directory))
-                ret = asprintf(&filepath, "vncterm.statefile");
-            else
-                ret = asprintf(&filepath, "/tmp/vncterm.statefile.%d", getpid());
-            if (ret < 0)
-                err(1, "asprintf");
-	    dump_console_to_file(vncterm->console, filepath);
-
-#ifndef NXENSTORE
-            if (xenstore_path) {
-                char *fullfilepath;
-                if (filepath[0] != '/') {
-                    ret = asprintf(&fullfilepath, "%s/vncterm.statefile", root_directory);
-                    if (ret < 0)
-                        err(1, "asprintf");
-                } else {
-                    fullfilepath = malloc(strlen(filepath) + 1);
-                    if (!fullfilepath)
-                        err(1, "malloc");
-                    memcpy (fullfilepath, filepath, strlen(filepath) + 1);
-                }
-                privsep_statefile_completed(fullfilepath);
-                free(fullfilepath);
-            }
-#endif
-            free(filepath);
+            for (vncterm = vncterms; vncterm; vncterm = vncterm->next)
+                dump_vncterm(vncterm);
 	}
 
 	if (handlers_updated) {
@@ -1018,10 +1641,8 @@ main(int argc, char **argv, char **envp)
 		    err(1, "malloc");
 		max_pollfds = nr_handlers;
 	    }
-	    nfds = 0;
-	    for (ioh = iohandlers; ioh != NULL; ioh = ioh->next) {
-		if (!ioh->enabled)
-		    continue;
+	    for (nfds = 0; nfds < nr_handlers; nfds++) {
+		ioh = active_handlers[nfds];
 		pollfds[nfds].fd = ioh->fd;
 		pollfds[nfds].events = 0;
 		if (ioh->fd_read)
@@ -1029,40 +1650,34 @@ main(int argc, char **argv, char **envp)
 		if (ioh->fd_write)
 		    pollfds[nfds].events |= POLLOUT;
 		ioh->pollfd = &pollfds[nfds];
-		nfds++;
 	    }
 #else
 	    FD_ZERO(&rdset_m);
 	    FD_ZERO(&wrset_m);
 	    FD_ZERO(&exset_m);
 	    nfds = 0;
-	    for (ioh = iohandlers; ioh != NULL; ioh = ioh->next) {
-		if (!ioh->enabled)
-		    continue;
-		if (ioh->fd_read || ioh->fd_write) {
-		    FD_SET(ioh->fd, &exset_m);
-		    if (nfds <= ioh->fd)
-			nfds = ioh->fd + 1;
-		    if (ioh->fd_read)
-			FD_SET(ioh->fd, &rdset_m);
-		    if (ioh->fd_write)
-			FD_SET(ioh->fd, &wrset_m);
-		}
+	    for (i = 0; i < nr_handlers; i++) {
+		ioh = active_handlers[i];
+		FD_SET(ioh->fd, &exset_m);
+		if (nfds <= ioh->fd)
+		    nfds = ioh->fd + 1;
+		if (ioh->fd_read)
+		    FD_SET(ioh->fd, &rdset_m);
+		if (ioh->fd_write)
+		    FD_SET(ioh->fd, &wrset_m);
 	    }
 #endif
 	    handlers_updated = 0;
 	}
-	if (timers && timers->timeout != UINT64_MAX) {
-	    now = get_clock();
-	    if (timers->timeout < now)
-		timeout = 0;
-	    else if (timers->timeout - now > 60000)
-		timeout = 60000;
-	    else
-		timeout = timers->timeout - now;
-	} else
-	    timeout = 60000;
+	wait_generation = handler_generation;
+	timeout = timers_poll_timeout();
 	if (timeout) {
+#ifdef USE_EPOLL
+	    if (epoll_fd != -1)
+		ret = epoll_wait(epoll_fd, epoll_events, EPOLL_MAX_EVENTS,
+				 timeout);
+	    else
+#endif
 #ifdef USE_POLL
 	    ret = poll(pollfds, nfds, timeout);
 #else
@@ -1082,58 +1697,43 @@ main(int argc, char **argv, char **envp)
 	    err(1, "select failed");
 #endif
 	}
-	if (ret == 0) {
-	    now = get_clock();
-	    while (timers && timers->timeout < now) {
-		t = timers;
-		timers = t->next;
-		if (timers == NULL)
-		    timers_tail = &timers;
-		t->timeout = UINT64_MAX;
-		t->next = NULL;
-		*timers_tail = t;
-		timers_tail = &t->next;
-		t->callback(t->opaque);
-	    }
+	run_timers();
+#ifdef USE_EPOLL
+	/* the epoll event flags are the poll ones */
+	for (i = 0; epoll_fd != -1 && i < ret; i++) {
+	    fd = epoll_events[i].data.fd;
+	    if (handle_fd_events(fd, epoll_events[i].events,
+				 wait_generation) == -1)
+		vncterm_input_closed(fd);
 	}
+	if (epoll_fd != -1)
+	    continue;
+#endif
 	if (ret > 0) {
-	    ioh = iohandlers;
-	    for (ioh = iohandlers; ioh != NULL; ioh = next) {
-		next = ioh->next;
 #ifdef USE_POLL
-		if (ioh->pollfd == NULL)
+	    for (i = 0; i < nfds; i++) {
+		revents = pollfds[i].revents;
+		if (revents == 0)
+		    continue;
+		fd = pollfds[i].fd;
+		/* skip fds unregistered or registered anew since the poll */
+		ioh = lookup_fd_handler(fd);
+		if (ioh == NULL || ioh->pollfd != &pollfds[i])
 		    continue;
-		revents = ioh->pollfd->revents;
 #else
+	    for (fd = 0; fd < nfds; fd++) {
 		revents = 0;
-		if (FD_ISSET(ioh->fd, &rdset))
+		if (FD_ISSET(fd, &rdset))
 		    revents |= POLLIN;
-		if (FD_ISSET(ioh->fd, &wrset))
+		if (FD_ISSET(fd, &wrset))
 		    revents |= POLLOUT;
-		if (FD_ISSET(ioh->fd, &exset))
+		if (FD_ISSET(fd, &exset))
 		    revents |= POLLERR;
-#endif
 		if (revents == 0)
 		    continue;
-		if (revents & (POLLERR|POLLHUP|POLLNVAL)) {
-		    if (ioh->fd == console_input_fd(vncterm->console)) {
-                ds->dpy_close_vncviewer_connections(ds);
-			if (restart)
-			    restart_needed = 1;
-			else if (exit_on_eof)
-			    exit_when_all_disconnect=1;
-		    }
-		    if (ioh->fd_error)
-			ioh->fd_error(ioh->opaque);
-		    ioh->enabled = 0;
-		    ioh->pollfd = NULL;
-		    handlers_updated = 1;
-		    continue;
-		}
-		if (revents & POLLOUT && ioh->fd_write)
-		    ioh->fd_write(ioh->opaque);
-		if (revents & POLLIN && ioh->fd_read)
-		    ioh->fd_read(ioh->opaque);
+#endif
+		if (handle_fd_events(fd, revents, wait_generation) == -1)
+		    vncterm_input_closed(fd);
 	    }
 	}
     }